@@ -1,154 +1,324 @@
 //==--- tools/clang-check/ClangInterpreter.cpp - Clang Interpreter tool
 //--------------===//
 //===----------------------------------------------------------------------===//
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
 
 #include "clang/AST/ASTConsumer.h"
-#include "clang/AST/EvaluatedExprVisitor.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
 
 using namespace clang;
 
 #include "Environment.h"
+#include "Bytecode.h"
+#include "BytecodeCache.h"
+#include "Closure.h"
+#include "Jit.h"
+#include "Optimizer.h"
+#include "Profiler.h"
 
-class InterpreterVisitor : public EvaluatedExprVisitor<InterpreterVisitor> {
-private:
-    Environment *mEnv;
-
-public:
-    explicit InterpreterVisitor(const ASTContext &context, Environment *env) : EvaluatedExprVisitor(context), mEnv(env) {}
-    virtual ~InterpreterVisitor() {}
+static llvm::cl::opt<bool> UseBytecode("vm", llvm::cl::desc("Lower the program to register bytecode and run it on the VM"), llvm::cl::init(false));
+static llvm::cl::opt<bool> Batch("batch", llvm::cl::desc("Read GET values without prompting and buffer PRINT output on stdout"), llvm::cl::init(false));
+static llvm::cl::opt<std::string> InputFile("input", llvm::cl::desc("File to read GET values from in batch mode ('-' for stdin)"), llvm::cl::value_desc("filename"), llvm::cl::init("-"));
+static llvm::cl::opt<std::string> ProgramFile("f", llvm::cl::desc("Read the program from <filename> instead of the command line"), llvm::cl::value_desc("filename"), llvm::cl::init(""));
+static llvm::cl::opt<std::string> CacheDir("cache-dir", llvm::cl::desc("Cache lowered bytecode in <directory> and reuse it without running the frontend (implies -vm)"), llvm::cl::value_desc("directory"), llvm::cl::init(""));
+static llvm::cl::opt<std::string> InputsFile("inputs", llvm::cl::desc("Run the program once per line of <filename>, each line holding the GET values of one run"), llvm::cl::value_desc("filename"), llvm::cl::init(""));
+static llvm::cl::opt<unsigned> Jobs("j", llvm::cl::desc("Number of worker threads for -inputs (0 = one per hardware thread)"), llvm::cl::init(0));
+static llvm::cl::opt<bool> DisableOpt("disable-opt", llvm::cl::desc("Interpret the AST as written, without constant folding, dead branch removal or loop-invariant hoisting"), llvm::cl::init(false));
+static llvm::cl::opt<std::string> ProfileFile("profile", llvm::cl::desc("Profile the AST interpreter and write collapsed stacks (self time in ns) to <filename>"), llvm::cl::value_desc("filename"), llvm::cl::init(""));
+static llvm::cl::opt<std::string> ProfileSummary("profile-summary", llvm::cl::desc("Profile the AST interpreter and write per-function, per-line, per-statement and per-loop counts to <filename>"), llvm::cl::value_desc("filename"), llvm::cl::init(""));
+static llvm::cl::opt<bool> UseJit("jit", llvm::cl::desc("Compile hot functions and loops of the AST interpreter to native code"), llvm::cl::init(false));
+static llvm::cl::opt<unsigned> JitCalls("jit-calls", llvm::cl::desc("Calls after which -jit compiles a function"), llvm::cl::init(100));
+static llvm::cl::opt<unsigned> JitLoops("jit-loops", llvm::cl::desc("Loop iterations after which -jit compiles the running loop"), llvm::cl::init(1000));
+static llvm::cl::opt<bool> UseClosures("closures", llvm::cl::desc("Compile the AST to a tree of specialized closures and run that instead of the tree walker"), llvm::cl::init(false));
+static llvm::cl::opt<bool> CheckClosures("check-closures", llvm::cl::desc("Run every input (from -inputs, or the whole GET input as one run) on both the tree walker and the closure engine, print the closure output and report runs whose output differs"), llvm::cl::init(false));
+static llvm::cl::opt<unsigned> Bench("bench", llvm::cl::desc("Count statements and calls in one profiled run, then time <n> executions on the selected engine and print the results as one JSON line"), llvm::cl::value_desc("n"), llvm::cl::init(0));
+static llvm::cl::opt<unsigned long> StackBudget("stack-budget", llvm::cl::desc("Bytes the AST interpreter may use for frames, locals and pending work before a call fails; the closure engine counts its native stack against it"), llvm::cl::value_desc("bytes"), llvm::cl::init(1UL << 30));
+static llvm::cl::opt<std::string> ProgramText(llvm::cl::Positional, llvm::cl::desc("<program text>"), llvm::cl::init(""));
 
-    bool visit(Expr *condition) { Visit(condition); return true; }
-    bool isDone() { return mEnv->isCurFuncReturned(); }
-    //访问圆括号语句
-    virtual void VisitParenExpr(ParenExpr *pexpr) {
-        if(isDone()) return;
-        VisitStmt(pexpr);
-        mEnv->parenexpr(pexpr);
-    }
-    //访问一元操作符 -a
-    virtual void VisitUnaryOperator(UnaryOperator *uop) {
-        if(isDone()) return;
-        VisitStmt(uop);
-        mEnv->unaryop(uop);
-    }
-    //访问二元操作符 a > b
-    virtual void VisitBinaryOperator(BinaryOperator *bop) {
-        if(isDone()) return;
-        VisitStmt(bop);
-        mEnv->binop(bop);
-    }
-    //声明再次调用 int a then a = 1的a
-    virtual void VisitDeclRefExpr(DeclRefExpr *expr) {
-        if(isDone()) return;
-        VisitStmt(expr);
-        mEnv->declref(expr);
-    }
-    virtual void VisitCastExpr(CastExpr *expr) {
-        if(isDone()) return;
-        VisitStmt(expr);
-        mEnv->cast(expr);
-    }
-    //访问数组
-    virtual void VisitArraySubscriptExpr(ArraySubscriptExpr *expr) {
-        if(isDone()) return;
-        Visit(expr->getLHS());
-        Visit(expr->getRHS());
-        mEnv->arrayref(expr);
-    }
-    //访问返回语句 exp: return 0;
-    virtual void VisitReturnStmt(ReturnStmt *rets) {
-        if(isDone()) return;
-        Visit(rets->getRetValue());
-        mEnv->retstmt(rets);
-    }
-    //访问调用语句
-    virtual void VisitCallExpr(CallExpr *call) {
-        if(isDone()) return;
-        VisitStmt(call);
-        mEnv->call(call);
-        FunctionDecl *callee = call->getCalleeDecl()->getAsFunction();
-        if(mEnv->isExternalCall(callee)) return; //当call为外部调用时
-        if(callee->hasBody()) VisitStmt(callee->getBody());
-        mEnv->ret(call); //调用结束后调用返回函数，释放临时栈，返回值
-    }
-    //访问赋值语句, exp:a = 1
-    virtual void VisitDeclStmt(DeclStmt *declstmt) {
-        if(isDone()) return;
-        VisitStmt(declstmt);
-        mEnv->decl(declstmt);
-    }
-    //访问while语句
-    virtual void VisitWhileStmt(WhileStmt *whilestmt) {
-        if(isDone()) return;
-        Expr *condition = whilestmt->getCond(); //获取while的条件语句
-        while (visit(condition) && mEnv->expr(condition)) {
-            Visit(whilestmt->getBody());
-            if(isDone()) return;
-        }
-    }
-    //访问for循环语句
-    virtual void VisitForStmt(ForStmt *forstmt) {
-        if(isDone()) return;
-        Stmt *initstmt = forstmt->getInit(), *body = forstmt->getBody(); //for的初始化和主体
-        Expr *condition = forstmt->getCond(), *inc = forstmt->getInc(); //for的条件和自增
-        if(initstmt) VisitStmt(initstmt);
-        bool flag = condition ? false : true;
-        while(flag || (visit(condition) && mEnv->expr(condition))) {
-            Visit(body); Visit(inc);//先主体部分，后inc
-            if(isDone()) return;
+//对每组输入各建一份输入输出并在线程池中调用run，全部完成后按输入顺序逐行打印各次的输出
+//run在各线程中并发执行，只能读取共享的AST或字节码，栈、堆和输出都须属于本次运行
+static void runInputs(const std::vector<std::string> &inputs, std::function<void(InterpreterIO &)> run) {
+    std::vector<std::string> outputs(inputs.size());
+    {
+        llvm::ThreadPool pool(llvm::hardware_concurrency(Jobs));
+        for(size_t i = 0; i < inputs.size(); i++) {
+            pool.async([&, i] {
+                InterpreterIO io;
+                io.setMemory(inputs[i], outputs[i]);
+                run(io);
+                io.flush();
+            });
         }
+        pool.wait();
     }
-    //访问if语句
-    virtual void VisitIfStmt(IfStmt *ifstmt) {
-        if(isDone()) return;
-        Expr *condition = ifstmt->getCond();
-        if(visit(condition) && mEnv->expr(condition)) Visit(ifstmt->getThen());
-        else if(ifstmt->getElse()) Visit(ifstmt->getElse()); //访问false分支
-    }
-    virtual void VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr *tte) {
-        if(isDone()) return;
-        VisitStmt(tte);
-        if(tte->getKind() == UETT_SizeOf) mEnv->sizeofexpr(tte);
-    }
-    //访问整数型常量
-    virtual void VisitIntegerLiteral(IntegerLiteral *il) {
-        if(isDone()) return;
-        mEnv->integerLiteral(il);
-    }
-    //访问字符型常量
-    virtual void VisitCharacterLiteral(CharacterLiteral *cl) {
-        if(isDone()) return;
-        mEnv->characterLiteral(cl);
-    }
-};
+    for(const std::string &output : outputs) llvm::outs() << output << "\n";
+    llvm::outs().flush();
+}
+
+static bool ClosuresDiffer = false; //-check-closures发现了输出不同的运行
+static std::chrono::steady_clock::time_point FrontendStart; //开始解析程序的时刻，-bench据此计算前端用时
+
+static double millis(std::chrono::steady_clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); }
+
+static void runClosures(const ClosureProgram &program, InterpreterIO &io) {
+    ClosureEngine engine(program, io);
+    engine.setStackBudget(StackBudget);
+    engine.run();
+}
 
 class InterpreterConsumer : public ASTConsumer {
 private:
+    InterpreterIO *mIO; //输入输出
+    BytecodeCache *mCache; //字节码缓存，未启用时为NULL
+    const std::vector<std::string> *mInputs; //-inputs给出的各组输入，未启用时为NULL
+    std::unique_ptr<Profiler> mProf; //未开启剖析时为NULL
     Environment mEnv; //环境类
-    InterpreterVisitor mVisitor; //AST遍历器
+
+    //把剖析结果写入path，path为空时跳过
+    template <class Writer>
+    static void writeProfile(const std::string &path, Writer write) {
+        if(path.empty()) return;
+        std::error_code ec;
+        llvm::raw_fd_ostream os(path, ec);
+        if(ec) {
+            llvm::errs() << "cannot open profile file " << path << ": " << ec.message() << "\n";
+            return;
+        }
+        write(os);
+    }
+    //在每组输入上分别运行AST遍历器与闭包引擎，结果不同的运行报告到stderr
+    void checkClosures(TranslationUnitDecl *unit) {
+        ClosureProgram program;
+        bool compiled = ClosureCompiler(program).compile(unit);
+        if(!compiled) llvm::errs() << "note: the closure engine does not compile this program and falls back to the tree walker\n";
+        for(size_t i = 0; i < mInputs->size(); i++) {
+            std::string walked, closed;
+            {
+                InterpreterIO io;
+                io.setMemory((*mInputs)[i], walked);
+                Environment env(&io);
+                env.setStackBudget(StackBudget);
+                env.init(unit);
+                env.run();
+            }
+            if(compiled) {
+                InterpreterIO io;
+                io.setMemory((*mInputs)[i], closed);
+                runClosures(program, io);
+            } else closed = walked;
+            llvm::outs() << closed << "\n";
+            if(walked != closed) {
+                llvm::errs() << "error: run " << i + 1 << ": the tree walker printed '" << walked << "' but the closure engine printed '" << closed << "'\n";
+                ClosuresDiffer = true;
+            }
+        }
+        llvm::outs().flush();
+    }
+    //-bench：先在AST遍历器上剖析一次，数出语句与调用次数，再在所选的执行方式上计时执行Bench次，
+    //每次依次运行全部输入，输出不计入时间
+    void bench(TranslationUnitDecl *unit, double frontendMs, double optimizeMs) {
+        typedef std::chrono::steady_clock Clock;
+        Profiler prof;
+        for(const std::string &input : *mInputs) {
+            std::string output;
+            InterpreterIO io;
+            io.setMemory(input, output);
+            Environment env(&io);
+            env.setProfiler(&prof);
+            env.setStackBudget(StackBudget);
+            env.init(unit);
+            env.run();
+        }
+        Clock::time_point start = Clock::now();
+        std::string engine = UseJit ? "jit" : "walker";
+        std::function<void(InterpreterIO &)> run = [unit](InterpreterIO &io) {
+            Environment env(&io);
+            env.setStackBudget(StackBudget);
+            env.init(unit);
+            std::unique_ptr<Jit> jit; //每次运行重新编译，编译时间计入执行时间
+            if(UseJit) {
+                jit.reset(new Jit(env, JitCalls, JitLoops));
+                env.setJit(jit.get());
+            }
+            env.run();
+        };
+        BCProgram bytecode;
+        ClosureProgram closures;
+        if(UseBytecode && BytecodeCompiler(bytecode).compile(unit)) {
+            engine = "vm";
+            run = [&bytecode](InterpreterIO &io) { BytecodeVM(bytecode, io).run(); };
+        } else if(UseClosures && ClosureCompiler(closures).compile(unit)) {
+            engine = "closures";
+            run = [&closures](InterpreterIO &io) { runClosures(closures, io); };
+        }
+        double lowerMs = millis(Clock::now() - start);
+        std::vector<double> times;
+        for(unsigned i = 0; i < Bench; i++) {
+            Clock::time_point begin = Clock::now();
+            for(const std::string &input : *mInputs) {
+                std::string output;
+                InterpreterIO io;
+                io.setMemory(input, output);
+                run(io);
+            }
+            times.push_back(millis(Clock::now() - begin));
+        }
+        std::sort(times.begin(), times.end());
+        double median = times[times.size() / 2], seconds = median / 1000;
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        llvm::json::Object result{
+            {"program", ProgramFile.empty() ? std::string("<command line>") : std::string(ProgramFile)},
+            {"engine", engine},
+            {"iterations", (int64_t)Bench},
+            {"frontend_ms", frontendMs},
+            {"optimize_ms", optimizeMs},
+            {"lower_ms", lowerMs},
+            {"exec_ms_min", times.front()},
+            {"exec_ms_median", median},
+            {"exec_ms_max", times.back()},
+            {"stmts", (int64_t)prof.totalStmts()},
+            {"calls", (int64_t)prof.totalCalls()},
+            {"stmts_per_sec", seconds > 0 ? prof.totalStmts() / seconds : 0.0},
+            {"calls_per_sec", seconds > 0 ? prof.totalCalls() / seconds : 0.0},
+            {"peak_rss_kb", (int64_t)usage.ru_maxrss}, //Linux上以KB为单位
+        };
+        llvm::outs() << llvm::json::Value(std::move(result)) << "\n";
+        llvm::outs().flush();
+    }
 
 public:
-    explicit InterpreterConsumer(const ASTContext &context) : mEnv(), mVisitor(context, &mEnv) {}
+    explicit InterpreterConsumer(const ASTContext &context, InterpreterIO *io, BytecodeCache *cache, const std::vector<std::string> *inputs) : mIO(io), mCache(cache), mInputs(inputs), mProf(ProfileFile.empty() && ProfileSummary.empty() ? NULL : new Profiler()), mEnv(io) {
+        mEnv.setProfiler(mProf.get());
+        mEnv.setStackBudget(StackBudget);
+    }
     virtual ~InterpreterConsumer() {}
 
     virtual void HandleTranslationUnit(clang::ASTContext &Context) {
+        double frontendMs = millis(std::chrono::steady_clock::now() - FrontendStart);
+        std::chrono::steady_clock::time_point optStart = std::chrono::steady_clock::now();
+        if(!DisableOpt) Optimizer(Context).run(Context.getTranslationUnitDecl());
+        if(Bench) return bench(Context.getTranslationUnitDecl(), frontendMs, millis(std::chrono::steady_clock::now() - optStart));
+        if(mProf) { //剖析的是AST遍历器，不走字节码和并行运行
+            mEnv.init(Context.getTranslationUnitDecl());
+            mEnv.run();
+            mIO->flush();
+            writeProfile(ProfileFile, [this](llvm::raw_ostream &os) { mProf->writeCollapsed(os); });
+            writeProfile(ProfileSummary, [this, &Context](llvm::raw_ostream &os) { mProf->writeSummary(os, Context.getSourceManager()); });
+            return;
+        }
+        if(CheckClosures) return checkClosures(Context.getTranslationUnitDecl());
+        if(UseBytecode || mCache) { //降低为字节码执行，含有不支持的结构时回退到AST遍历
+            BCProgram program;
+            if(BytecodeCompiler(program).compile(Context.getTranslationUnitDecl())) {
+                if(mCache) mCache->store(program);
+                if(mInputs) runInputs(*mInputs, [&program](InterpreterIO &io) { BytecodeVM(program, io).run(); });
+                else BytecodeVM(program, *mIO).run();
+                return;
+            }
+        }
+        if(UseClosures) { //编译为闭包树执行，含有不支持的结构时回退到AST遍历
+            ClosureProgram program;
+            if(ClosureCompiler(program).compile(Context.getTranslationUnitDecl())) {
+                if(mInputs) runInputs(*mInputs, [&program](InterpreterIO &io) { runClosures(program, io); });
+                else runClosures(program, *mIO);
+                return;
+            }
+        }
+        if(mInputs) { //AST只读，每次运行各用一份Environment，类型大小在启动线程前求好后共享
+            TranslationUnitDecl *unit = Context.getTranslationUnitDecl();
+            TypeLayout layout;
+            Environment::computeLayout(unit, layout);
+            runInputs(*mInputs, [unit, &layout](InterpreterIO &io) {
+                Environment env(&io);
+                env.setStackBudget(StackBudget);
+                env.setLayout(&layout);
+                env.init(unit);
+                env.run();
+            });
+            return;
+        }
         mEnv.init(Context.getTranslationUnitDecl()); //以根节点为参数传入mEnv
-        mVisitor.VisitStmt(mEnv.getEntry()->getBody()); //开始遍历main函数中的语句
+        std::unique_ptr<Jit> jit;
+        if(UseJit) { //分层执行：热点函数与循环编译为本机代码
+            jit.reset(new Jit(mEnv, JitCalls, JitLoops));
+            mEnv.setJit(jit.get());
+        }
+        mEnv.run(); //开始执行main函数中的语句
     }
 };
 
 class InterpreterClassAction : public ASTFrontendAction {
+    InterpreterIO *mIO;
+    BytecodeCache *mCache;
+    const std::vector<std::string> *mInputs;
 public:
+    InterpreterClassAction(InterpreterIO *io, BytecodeCache *cache, const std::vector<std::string> *inputs) : mIO(io), mCache(cache), mInputs(inputs) {}
     virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(clang::CompilerInstance &Compiler, llvm::StringRef InFile) {
-        return std::unique_ptr<clang::ASTConsumer>(new InterpreterConsumer(Compiler.getASTContext()));
+        return std::unique_ptr<clang::ASTConsumer>(new InterpreterConsumer(Compiler.getASTContext(), mIO, mCache, mInputs));
     }
 };
 
 int main(int argc, char **argv) {
-    if(argc > 1) {
-        clang::tooling::runToolOnCode( std::unique_ptr<clang::FrontendAction>(new InterpreterClassAction), argv[1]);
+    llvm::cl::ParseCommandLineOptions(argc, argv, "AST Interpreter\n");
+    InterpreterIO io;
+    if(Batch && !io.setBatch(InputFile)) {
+        llvm::errs() << "cannot open input file " << InputFile << "\n";
+        return 1;
+    }
+    std::string program = ProgramText;
+    if(!ProgramFile.empty()) {
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(ProgramFile);
+        if(!buffer) {
+            llvm::errs() << "cannot open program file " << ProgramFile << "\n";
+            return 1;
+        }
+        program = (*buffer)->getBuffer().str();
+    }
+    if(program.empty()) return 0;
+    std::vector<std::string> inputs;
+    if(!InputsFile.empty()) {
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFileOrSTDIN(InputsFile);
+        if(!buffer) {
+            llvm::errs() << "cannot open input file " << InputsFile << "\n";
+            return 1;
+        }
+        llvm::StringRef text = (*buffer)->getBuffer(), line; //空行表示一次没有输入的运行
+        while(!text.empty()) {
+            std::tie(line, text) = text.split('\n');
+            inputs.push_back(line.str());
+        }
+    } else if(CheckClosures || Bench) { //没有-inputs时整个GET输入作为一次运行
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFileOrSTDIN(InputFile);
+        if(!buffer) {
+            llvm::errs() << "cannot open input file " << InputFile << "\n";
+            return 1;
+        }
+        inputs.push_back((*buffer)->getBuffer().str());
+    }
+    std::unique_ptr<BytecodeCache> cache;
+    if(!CacheDir.empty() && ProfileFile.empty() && ProfileSummary.empty() && !CheckClosures && !Bench) { //缓存命中时不再运行前端，剖析、对比引擎与计时时总是运行AST遍历器
+        cache.reset(new BytecodeCache(CacheDir, program, !DisableOpt));
+        BCProgram bytecode;
+        if(cache->load(bytecode)) {
+            if(!InputsFile.empty()) runInputs(inputs, [&bytecode](InterpreterIO &io) { BytecodeVM(bytecode, io).run(); });
+            else BytecodeVM(bytecode, io).run();
+            io.flush();
+            return 0;
+        }
     }
+    FrontendStart = std::chrono::steady_clock::now();
+    clang::tooling::runToolOnCode( std::unique_ptr<clang::FrontendAction>(new InterpreterClassAction(&io, cache.get(), InputsFile.empty() && !CheckClosures && !Bench ? NULL : &inputs)), program);
+    io.flush();
+    return ClosuresDiffer ? 1 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,452 @@
+//==--- Bytecode.h - 寄存器式字节码编译器与虚拟机 ---------------------------===//
+//
+// 将入口函数及其调用到的函数一次性降低为紧凑的寄存器字节码，
+// 之后在一个分发循环中执行，不再反复遍历AST
+//===----------------------------------------------------------------------===//
+#ifndef _BYTECODE_H_
+#define _BYTECODE_H_
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Environment.h"
+
+//字节码操作码，a/b/c为寄存器编号，k为立即数或跳转目标
+enum BCOp : unsigned char {
+    OP_LOADK,   // R[a] = k
+    OP_MOV,     // R[a] = R[b]
+    OP_GETG,    // R[a] = G[b]
+    OP_SETG,    // G[a] = R[b]
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_REM, // R[a] = R[b] op R[c]
+    OP_PTRADD,  // R[a] = R[b] + R[c] * k
+    OP_PTRSUB,  // R[a] = R[b] - R[c] * k
+    OP_GT, OP_LT, OP_EQ, OP_GE, OP_LE, OP_NE,
+    OP_NEG,     // R[a] = -R[b]
+    OP_LOAD,    // R[a] = *R[b]    (经过堆检查)
+    OP_STORE,   // *R[a] = R[b]    (经过堆检查)
+    OP_ALOAD,   // R[a] = R[b][R[c]]
+    OP_ASTORE,  // R[a][R[b]] = R[c]   以上四条的k为encodeMem给出的元素类型
+    OP_ARRAY,   // R[a] = &A[k]，A为当前栈帧的数组区
+    OP_JMP,     // pc = k
+    OP_JZ,      // if(!R[a]) pc = k
+    OP_CALL,    // R[a] = funcs[b](R[c], ..., R[c+k-1])
+    OP_RET,     // return b ? R[a] : 0
+    OP_GET, OP_PRINT, OP_MALLOC, OP_FREE // 内建函数
+};
+
+struct BCInst {
+    BCOp op;
+    int a, b, c;
+    long k;
+};
+
+//内存访问指令的k：低8位为元素大小，第8位为符号
+static long encodeMem(MemType type) { return type.size | (type.isSigned ? 0x100 : 0); }
+static MemType decodeMem(long k) { return MemType{(unsigned char)(k & 0xff), (k & 0x100) != 0}; }
+
+//一个函数的字节码，参数位于寄存器[0, numParams)，随后为局部变量和临时值
+struct BCFunction {
+    std::string name;
+    unsigned numParams = 0;
+    unsigned numRegs = 0;
+    unsigned arrayWords = 0; //全部局部数组的大小，调用时一次性分配
+    std::vector<BCInst> code;
+};
+
+struct BCProgram {
+    std::vector<BCFunction> funcs;
+    unsigned numGlobals = 0;
+    int init = -1;  //全局变量初始化函数
+    int entry = -1; //main
+};
+
+//将AST降低为字节码，遇到解释器不支持的结构时返回false，由调用者回退到AST遍历
+class BytecodeCompiler {
+    BCProgram &mProg;
+    ASTContext *mContext;
+    FunctionDecl *mFree, *mMalloc, *mInput, *mOutput;
+    std::map<FunctionDecl *, int> mFuncs; //规范声明 -> 函数编号
+    std::vector<FunctionDecl *> mPending; //待编译的函数
+    std::map<VarDecl *, int> mGlobals;
+    std::map<VarDecl *, int> mLocals;
+    BCFunction *mFn; //当前正在编译的函数
+    unsigned mTop; //下一个空闲的临时寄存器
+    bool mOk;
+
+    int fail() { mOk = false; return 0; }
+    int tmp() {
+        int r = mTop++;
+        if(mTop > mFn->numRegs) mFn->numRegs = mTop;
+        return r;
+    }
+    int target(int dst) { return dst >= 0 ? dst : tmp(); }
+    size_t emit(BCOp op, int a = 0, int b = 0, int c = 0, long k = 0) {
+        mFn->code.push_back(BCInst{op, a, b, c, k});
+        return mFn->code.size() - 1;
+    }
+    void patch(size_t at) { mFn->code[at].k = mFn->code.size(); }
+    long mem(QualType type) { return encodeMem(Environment::memTypeOf(*mContext, type)); }
+    int funcIndex(FunctionDecl *fd) {
+        FunctionDecl *canon = fd->getCanonicalDecl();
+        std::map<FunctionDecl *, int>::iterator it = mFuncs.find(canon);
+        if(it != mFuncs.end()) return it->second;
+        int idx = mProg.funcs.size();
+        mProg.funcs.push_back(BCFunction());
+        mFuncs[canon] = idx;
+        mPending.push_back(canon);
+        return idx;
+    }
+    //把变量声明降低为对其槽位的初始化
+    void vardecl(VarDecl *vd, int slot, bool global) {
+        const Type *type = vd->getType().getTypePtr();
+        int r = global ? tmp() : slot;
+        if(isa<ConstantArrayType>(type)) {
+            emit(OP_ARRAY, r, 0, 0, mFn->arrayWords);
+            mFn->arrayWords += Environment::wordsOf(*mContext, vd->getType());
+        } else if((type->isIntegerType() || type->isPointerType()) && vd->hasInit()) {
+            expr(vd->getInit(), r);
+        } else emit(OP_LOADK, r, 0, 0, 0);
+        if(global) emit(OP_SETG, slot, r);
+    }
+    int declref(DeclRefExpr *ref, int dst) {
+        VarDecl *vd = dyn_cast<VarDecl>(ref->getDecl());
+        if(!vd) return fail();
+        std::map<VarDecl *, int>::iterator it = mLocals.find(vd);
+        if(it != mLocals.end()) {
+            if(dst < 0 || dst == it->second) return it->second; //局部变量直接使用其寄存器
+            emit(OP_MOV, dst, it->second);
+            return dst;
+        }
+        it = mGlobals.find(vd);
+        if(it == mGlobals.end()) return fail();
+        int r = target(dst);
+        emit(OP_GETG, r, it->second);
+        return r;
+    }
+    //与AST遍历一致，先求左侧的下标或地址，再求右侧的值
+    int assignment(Expr *left, Expr *right, int dst) {
+        left = left->IgnoreParens();
+        if(DeclRefExpr *ref = dyn_cast<DeclRefExpr>(left)) {
+            VarDecl *vd = dyn_cast<VarDecl>(ref->getDecl());
+            if(!vd) return fail();
+            std::map<VarDecl *, int>::iterator it = mLocals.find(vd);
+            if(it != mLocals.end()) {
+                int r = expr(right, it->second);
+                if(dst < 0 || dst == r) return r;
+                emit(OP_MOV, dst, r);
+                return dst;
+            }
+            it = mGlobals.find(vd);
+            if(it == mGlobals.end()) return fail();
+            int r = expr(right, dst);
+            emit(OP_SETG, it->second, r);
+            return r;
+        } else if(ArraySubscriptExpr *ase = dyn_cast<ArraySubscriptExpr>(left)) {
+            int base = expr(ase->getBase(), -1), idx = expr(ase->getIdx(), -1);
+            int r = expr(right, dst);
+            emit(OP_ASTORE, base, idx, r, mem(ase->getType()));
+            return r;
+        } else if(UnaryOperator *uop = dyn_cast<UnaryOperator>(left)) {
+            if(uop->getOpcode() != UO_Deref) return fail();
+            int addr = expr(uop->getSubExpr(), -1);
+            int r = expr(right, dst);
+            emit(OP_STORE, addr, r, 0, mem(uop->getType()));
+            return r;
+        }
+        return fail();
+    }
+    int binop(BinaryOperator *bop, int dst) {
+        Expr *left = bop->getLHS(), *right = bop->getRHS();
+        if(bop->getOpcode() == BO_Assign) return assignment(left, right, dst);
+        BCOp op;
+        long scale = 0;
+        switch(bop->getOpcode()) {
+            case BO_GT: op = OP_GT; break;
+            case BO_LT: op = OP_LT; break;
+            case BO_EQ: op = OP_EQ; break;
+            case BO_GE: op = OP_GE; break;
+            case BO_LE: op = OP_LE; break;
+            case BO_NE: op = OP_NE; break;
+            case BO_Mul: op = OP_MUL; break;
+            case BO_Div: op = OP_DIV; break;
+            case BO_Rem: op = OP_REM; break;
+            case BO_Add:
+            case BO_Sub:
+                if((scale = Environment::scaleOf(*mContext, bop))) {
+                    op = bop->getOpcode() == BO_Add ? OP_PTRADD : OP_PTRSUB;
+                } else op = bop->getOpcode() == BO_Add ? OP_ADD : OP_SUB;
+                break;
+            default: return fail(); //逻辑、位运算与复合赋值交给AST遍历处理
+        }
+        int l = expr(left, -1), r = expr(right, -1);
+        int d = target(dst);
+        emit(op, d, l, r, scale);
+        return d;
+    }
+    int unaryop(UnaryOperator *uop, int dst) {
+        if(uop->getOpcode() == UO_Plus) return expr(uop->getSubExpr(), dst);
+        if(uop->getOpcode() != UO_Minus && uop->getOpcode() != UO_Deref) return fail();
+        int v = expr(uop->getSubExpr(), -1);
+        int d = target(dst);
+        if(uop->getOpcode() == UO_Minus) emit(OP_NEG, d, v);
+        else emit(OP_LOAD, d, v, 0, mem(uop->getType()));
+        return d;
+    }
+    int call(CallExpr *callexpr, int dst) {
+        FunctionDecl *callee = callexpr->getDirectCallee();
+        if(!callee) return fail();
+        if(callee == mInput) {
+            int d = target(dst);
+            emit(OP_GET, d);
+            return d;
+        } else if(callee == mOutput || callee == mFree) {
+            int v = expr(callexpr->getArg(0), dst);
+            emit(callee == mOutput ? OP_PRINT : OP_FREE, v);
+            return v;
+        } else if(callee == mMalloc) {
+            int v = expr(callexpr->getArg(0), -1);
+            int d = target(dst);
+            emit(OP_MALLOC, d, v);
+            return d;
+        }
+        FunctionDecl *def = callee->getDefinition();
+        if(!def || def->getNumParams() != callexpr->getNumArgs()) return fail();
+        //实参依次放在连续的寄存器中，调用时复制到被调函数的参数寄存器
+        unsigned nargs = callexpr->getNumArgs(), base = mTop;
+        for(unsigned i = 0; i < nargs; i++) tmp();
+        for(unsigned i = 0; i < nargs; i++) expr(callexpr->getArg(i), base + i);
+        int d = target(dst);
+        emit(OP_CALL, d, funcIndex(def), base, nargs);
+        return d;
+    }
+    //编译表达式，结果放在dst中（dst < 0时由编译器挑选寄存器），返回结果所在寄存器
+    int expr(Expr *exp, int dst) {
+        if(!mOk) return 0;
+        Expr *e = exp->IgnoreImpCasts();
+        if(BinaryOperator *bop = dyn_cast<BinaryOperator>(e)) return binop(bop, dst);
+        else if(IntegerLiteral *i = dyn_cast<IntegerLiteral>(e)) {
+            int d = target(dst);
+            emit(OP_LOADK, d, 0, 0, i->getValue().getSExtValue());
+            return d;
+        } else if(CharacterLiteral *i = dyn_cast<CharacterLiteral>(e)) {
+            int d = target(dst);
+            emit(OP_LOADK, d, 0, 0, i->getValue());
+            return d;
+        } else if(DeclRefExpr *i = dyn_cast<DeclRefExpr>(e)) return declref(i, dst);
+        else if(CallExpr *i = dyn_cast<CallExpr>(e)) return call(i, dst);
+        else if(UnaryOperator *i = dyn_cast<UnaryOperator>(e)) return unaryop(i, dst);
+        else if(ParenExpr *i = dyn_cast<ParenExpr>(e)) return expr(i->getSubExpr(), dst);
+        else if(ArraySubscriptExpr *i = dyn_cast<ArraySubscriptExpr>(e)) {
+            int base = expr(i->getBase(), -1), idx = expr(i->getIdx(), -1);
+            int d = target(dst);
+            emit(OP_ALOAD, d, base, idx, mem(i->getType()));
+            return d;
+        } else if(UnaryExprOrTypeTraitExpr *i = dyn_cast<UnaryExprOrTypeTraitExpr>(e)) {
+            if(i->getKind() != UETT_SizeOf) return fail();
+            int d = target(dst);
+            emit(OP_LOADK, d, 0, 0, Environment::sizeofexpr(*mContext, i));
+            return d;
+        } else if(CStyleCastExpr *i = dyn_cast<CStyleCastExpr>(e)) return expr(i->getSubExpr(), dst);
+        return fail();
+    }
+    //条件表达式为假时跳转，返回待回填的跳转指令位置
+    size_t branchIfFalse(Expr *cond) {
+        unsigned mark = mTop;
+        int c = expr(cond, -1);
+        mTop = mark;
+        return emit(OP_JZ, c);
+    }
+    void stmt(Stmt *s) {
+        if(!mOk || !s) return;
+        unsigned mark = mTop;
+        if(CompoundStmt *cs = dyn_cast<CompoundStmt>(s)) {
+            for(Stmt *child : cs->body()) stmt(child);
+        } else if(DeclStmt *ds = dyn_cast<DeclStmt>(s)) {
+            for(DeclStmt::decl_iterator it = ds->decl_begin(), ie = ds->decl_end(); it != ie; ++it)
+                if(VarDecl *vd = dyn_cast<VarDecl>(*it)) vardecl(vd, mLocals[vd], false);
+        } else if(IfStmt *is = dyn_cast<IfStmt>(s)) {
+            size_t jz = branchIfFalse(is->getCond());
+            stmt(is->getThen());
+            if(is->getElse()) {
+                size_t jmp = emit(OP_JMP);
+                patch(jz);
+                stmt(is->getElse());
+                patch(jmp);
+            } else patch(jz);
+        } else if(WhileStmt *ws = dyn_cast<WhileStmt>(s)) {
+            size_t top = mFn->code.size();
+            size_t jz = branchIfFalse(ws->getCond());
+            stmt(ws->getBody());
+            emit(OP_JMP, 0, 0, 0, top);
+            patch(jz);
+        } else if(ForStmt *fs = dyn_cast<ForStmt>(s)) {
+            stmt(fs->getInit());
+            size_t top = mFn->code.size(), jz = 0;
+            if(fs->getCond()) jz = branchIfFalse(fs->getCond());
+            stmt(fs->getBody());
+            if(fs->getInc()) expr(fs->getInc(), -1);
+            emit(OP_JMP, 0, 0, 0, top);
+            if(fs->getCond()) patch(jz);
+        } else if(ReturnStmt *rs = dyn_cast<ReturnStmt>(s)) {
+            if(rs->getRetValue()) emit(OP_RET, expr(rs->getRetValue(), -1), 1);
+            else emit(OP_RET);
+        } else if(Expr *e = dyn_cast<Expr>(s)) {
+            expr(e, -1);
+        } else if(!isa<NullStmt>(s)) fail(); //break、continue、do、switch等暂不支持
+        mTop = mark;
+    }
+    void function(FunctionDecl *fd, BCFunction &fn) {
+        fn.name = fd->getNameAsString();
+        fn.numParams = fd->getNumParams();
+        mFn = &fn;
+        mLocals.clear();
+        for(unsigned i = 0; i < fd->getNumParams(); i++) mLocals[fd->getParamDecl(i)] = i;
+        LocalCollector(mLocals).TraverseStmt(fd->getBody());
+        mTop = fn.numRegs = mLocals.size();
+        stmt(fd->getBody());
+        emit(OP_RET); //函数末尾没有return时返回0
+    }
+
+public:
+    explicit BytecodeCompiler(BCProgram &prog) : mProg(prog), mContext(NULL), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL), mFn(NULL), mTop(0), mOk(true) {}
+    bool compile(TranslationUnitDecl *unit) {
+        mContext = &unit->getASTContext();
+        FunctionDecl *entry = NULL;
+        BCFunction init;
+        init.name = "<init>";
+        mFn = &init;
+        for(TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i) {
+            if(VarDecl *vdecl = dyn_cast<VarDecl>(*i)) { //全局变量在初始化函数中赋初值
+                int slot = mProg.numGlobals++;
+                mGlobals[vdecl] = slot;
+                unsigned mark = mTop;
+                vardecl(vdecl, slot, true);
+                mTop = mark;
+            } else if(FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i)) {
+                if(fdecl->getName().equals("FREE")) mFree = fdecl;
+                else if(fdecl->getName().equals("MALLOC")) mMalloc = fdecl;
+                else if(fdecl->getName().equals("GET")) mInput = fdecl;
+                else if(fdecl->getName().equals("PRINT")) mOutput = fdecl;
+                else if(fdecl->getName().equals("main")) entry = fdecl;
+            }
+        }
+        emit(OP_RET);
+        if(!entry || !entry->hasBody() || !mOk) return false;
+        mProg.init = mProg.funcs.size();
+        mProg.funcs.push_back(init);
+        mProg.entry = funcIndex(entry->getDefinition());
+        while(!mPending.empty() && mOk) {
+            FunctionDecl *fd = mPending.back();
+            mPending.pop_back();
+            BCFunction fn;
+            function(fd->getDefinition(), fn);
+            mProg.funcs[mFuncs[fd]] = std::move(fn);
+        }
+        return mOk;
+    }
+};
+
+//字节码虚拟机，调用栈显式保存在mFrames中，解释执行不产生本地递归
+class BytecodeVM {
+    struct Frame {
+        const BCFunction *fn;
+        size_t pc;
+        size_t base;
+        int dst;
+        long *arrays;
+        FrameArena::Mark mark; //返回时数组区退回的位置
+    };
+    const BCProgram &mProg;
+    InterpreterIO &mIO;
+    Heap mHeap;
+    FrameArena mArena;
+    std::vector<long> mGlobals;
+    std::vector<long> mRegs; //所有活动函数的寄存器连续存放
+    std::vector<Frame> mFrames;
+
+    void reserve(size_t n) { if(mRegs.size() < n) mRegs.resize(std::max(n, mRegs.size() * 2)); }
+
+public:
+    BytecodeVM(const BCProgram &prog, InterpreterIO &io) : mProg(prog), mIO(io), mHeap(), mArena(), mGlobals(prog.numGlobals), mRegs(), mFrames() {}
+    void run() {
+        execute(&mProg.funcs[mProg.init]);
+        execute(&mProg.funcs[mProg.entry]);
+    }
+    //最外层函数的数组区不释放，全局数组因此在整个运行期间有效
+    long execute(const BCFunction *fn) {
+        size_t depth = mFrames.size(), base = 0, pc = 0;
+        reserve(fn->numRegs);
+        long *R = mRegs.data();
+        long *A = mArena.alloc(fn->arrayWords);
+        long *G = mGlobals.data();
+        const BCInst *code = fn->code.data();
+        for(;;) {
+            const BCInst &I = code[pc++];
+            switch(I.op) {
+                case OP_LOADK: R[I.a] = I.k; break;
+                case OP_MOV: R[I.a] = R[I.b]; break;
+                case OP_GETG: R[I.a] = G[I.b]; break;
+                case OP_SETG: G[I.a] = R[I.b]; break;
+                case OP_ADD: R[I.a] = R[I.b] + R[I.c]; break;
+                case OP_SUB: R[I.a] = R[I.b] - R[I.c]; break;
+                case OP_MUL: R[I.a] = R[I.b] * R[I.c]; break;
+                case OP_DIV: R[I.a] = R[I.b] / R[I.c]; break;
+                case OP_REM: R[I.a] = R[I.b] % R[I.c]; break;
+                case OP_PTRADD: R[I.a] = R[I.b] + R[I.c] * I.k; break;
+                case OP_PTRSUB: R[I.a] = R[I.b] - R[I.c] * I.k; break;
+                case OP_GT: R[I.a] = R[I.b] > R[I.c]; break;
+                case OP_LT: R[I.a] = R[I.b] < R[I.c]; break;
+                case OP_EQ: R[I.a] = R[I.b] == R[I.c]; break;
+                case OP_GE: R[I.a] = R[I.b] >= R[I.c]; break;
+                case OP_LE: R[I.a] = R[I.b] <= R[I.c]; break;
+                case OP_NE: R[I.a] = R[I.b] != R[I.c]; break;
+                case OP_NEG: R[I.a] = -R[I.b]; break;
+                case OP_LOAD: R[I.a] = mHeap.Get((char *)R[I.b], decodeMem(I.k)); break;
+                case OP_STORE: mHeap.Update((char *)R[I.a], decodeMem(I.k), R[I.b]); break;
+                case OP_ALOAD: {
+                    MemType type = decodeMem(I.k);
+                    R[I.a] = loadMem((char *)R[I.b] + R[I.c] * type.size, type);
+                    break;
+                }
+                case OP_ASTORE: {
+                    MemType type = decodeMem(I.k);
+                    storeMem((char *)R[I.a] + R[I.b] * type.size, type, R[I.c]);
+                    break;
+                }
+                case OP_ARRAY: R[I.a] = (long)(A + I.k); break;
+                case OP_JMP: pc = I.k; break;
+                case OP_JZ: if(!R[I.a]) pc = I.k; break;
+                case OP_GET: R[I.a] = mIO.get(); break;
+                case OP_PRINT: mIO.print(R[I.a]); break;
+                case OP_MALLOC: R[I.a] = (long)mHeap.Malloc(R[I.b]); break;
+                case OP_FREE: mHeap.Free((long *)R[I.a]); break;
+                case OP_CALL: {
+                    const BCFunction *callee = &mProg.funcs[I.b];
+                    size_t nbase = base + fn->numRegs;
+                    reserve(nbase + callee->numRegs);
+                    R = mRegs.data() + base;
+                    for(long i = 0; i < I.k; i++) R[fn->numRegs + i] = R[I.c + i];
+                    mFrames.push_back(Frame{fn, pc, base, I.a, A, mArena.mark()});
+                    fn = callee; code = fn->code.data(); pc = 0; base = nbase;
+                    R = mRegs.data() + base;
+                    A = mArena.alloc(fn->arrayWords);
+                    break;
+                }
+                case OP_RET: {
+                    long val = I.b ? R[I.a] : 0;
+                    if(mFrames.size() == depth) return val;
+                    Frame &f = mFrames.back();
+                    fn = f.fn; code = fn->code.data(); pc = f.pc; base = f.base;
+                    R = mRegs.data() + base;
+                    R[f.dst] = val;
+                    A = f.arrays;
+                    mArena.release(f.mark);
+                    mFrames.pop_back();
+                    break;
+                }
+            }
+        }
+    }
+};
+#endif /* !_BYTECODE_H_ */
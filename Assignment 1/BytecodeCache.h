@@ -0,0 +1,151 @@
+//==--- BytecodeCache.h - 字节码的磁盘缓存 ------------------------------===//
+//
+// 以程序文本与是否做过AST优化的MD5为键，把降低后的字节码保存在缓存目录中。
+// 再次运行同一程序时直接读入字节码交给虚拟机执行，完全跳过Clang前端。
+//===----------------------------------------------------------------------===//
+#ifndef _BYTECODECACHE_H_
+#define _BYTECODECACHE_H_
+#include <string.h>
+
+#include <string>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "Bytecode.h"
+
+class BytecodeCache {
+    //字节码格式改变时递增，旧的缓存文件随之失效
+    enum : unsigned { kMagic = 0x43424941, kVersion = 3 };
+    std::string mDir;
+    llvm::SmallString<128> mPath; //本程序对应的缓存文件
+
+    template <class T>
+    static void put(llvm::raw_ostream &os, T val) { os.write((const char *)&val, sizeof(T)); }
+    //按顺序读取定长字段，越界时返回false
+    struct Reader {
+        const char *cur, *end;
+        template <class T>
+        bool get(T &val) {
+            if((size_t)(end - cur) < sizeof(T)) return false;
+            memcpy(&val, cur, sizeof(T));
+            cur += sizeof(T);
+            return true;
+        }
+        size_t left() const { return end - cur; }
+    };
+    //每个函数至少有名字长度、参数数、寄存器数、数组大小与指令数这几个字段
+    enum : size_t { kMinFunction = 5 * sizeof(unsigned) };
+
+    //检查读入的指令：寄存器编号在函数的寄存器数之内，全局变量、被调函数、数组下标与跳转目标都不越界，
+    //函数以RET或JMP结尾，执行不会越过末尾
+    static bool valid(const BCProgram &program) {
+        for(const BCFunction &fn : program.funcs) {
+            if(fn.numParams > fn.numRegs || fn.code.empty()) return false;
+            if(fn.code.back().op != OP_RET && fn.code.back().op != OP_JMP) return false;
+            auto reg = [&fn](long r) { return r >= 0 && (unsigned)r < fn.numRegs; };
+            auto mem = [](long k) {
+                long size = k & 0xff;
+                return (k & ~0x1ffL) == 0 && (size == 1 || size == 2 || size == 4 || size == 8);
+            };
+            for(const BCInst &I : fn.code) {
+                bool ok;
+                switch(I.op) {
+                    case OP_LOADK: case OP_GET: case OP_PRINT: case OP_FREE: ok = reg(I.a); break;
+                    case OP_MOV: case OP_NEG: case OP_MALLOC: ok = reg(I.a) && reg(I.b); break;
+                    case OP_GETG: ok = reg(I.a) && I.b >= 0 && (unsigned)I.b < program.numGlobals; break;
+                    case OP_SETG: ok = I.a >= 0 && (unsigned)I.a < program.numGlobals && reg(I.b); break;
+                    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_REM: case OP_PTRADD: case OP_PTRSUB:
+                    case OP_GT: case OP_LT: case OP_EQ: case OP_GE: case OP_LE: case OP_NE:
+                        ok = reg(I.a) && reg(I.b) && reg(I.c); break;
+                    case OP_LOAD: case OP_STORE: ok = reg(I.a) && reg(I.b) && mem(I.k); break;
+                    case OP_ALOAD: case OP_ASTORE: ok = reg(I.a) && reg(I.b) && reg(I.c) && mem(I.k); break;
+                    case OP_ARRAY: ok = reg(I.a) && I.k >= 0 && (unsigned long)I.k <= fn.arrayWords; break;
+                    case OP_JMP: ok = I.k >= 0 && (size_t)I.k < fn.code.size(); break;
+                    case OP_JZ: ok = reg(I.a) && I.k >= 0 && (size_t)I.k < fn.code.size(); break;
+                    case OP_CALL:
+                        ok = reg(I.a) && I.b >= 0 && (size_t)I.b < program.funcs.size() && I.k >= 0 && (unsigned long)I.k <= program.funcs[I.b].numRegs;
+                        if(ok && I.k) ok = reg(I.c) && reg(I.c + I.k - 1);
+                        break;
+                    case OP_RET: ok = !I.b || reg(I.a); break;
+                    default: ok = false; break;
+                }
+                if(!ok) return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    //optimized为false时（-disable-opt）字节码由未经优化的AST降低而来，两者分开缓存
+    BytecodeCache(const std::string &dir, llvm::StringRef program, bool optimized) : mDir(dir), mPath(dir) {
+        llvm::MD5 hash;
+        llvm::MD5::MD5Result result;
+        llvm::SmallString<32> digest;
+        hash.update(program);
+        hash.update(optimized ? "-O" : "-disable-opt");
+        hash.final(result);
+        llvm::MD5::stringifyResult(result, digest);
+        llvm::sys::path::append(mPath, digest.str().str() + ".bc" + std::to_string((unsigned)kVersion));
+    }
+
+    //缓存文件损坏或被截断时返回false，由调用者重新编译
+    bool load(BCProgram &program) {
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(mPath);
+        if(!buffer) return false;
+        Reader in = {(*buffer)->getBufferStart(), (*buffer)->getBufferEnd()};
+        unsigned magic, version, nfuncs;
+        if(!in.get(magic) || !in.get(version) || magic != kMagic || version != kVersion) return false;
+        if(!in.get(program.numGlobals) || !in.get(program.init) || !in.get(program.entry) || !in.get(nfuncs)) return false;
+        if(nfuncs > in.left() / kMinFunction) return false; //计数与剩余字节不符时不分配，按未命中处理
+        program.funcs.resize(nfuncs);
+        for(BCFunction &fn : program.funcs) {
+            unsigned namelen, ncode;
+            if(!in.get(namelen) || (size_t)(in.end - in.cur) < namelen) return false;
+            fn.name.assign(in.cur, namelen);
+            in.cur += namelen;
+            if(!in.get(fn.numParams) || !in.get(fn.numRegs) || !in.get(fn.arrayWords) || !in.get(ncode)) return false;
+            if(ncode > in.left() / sizeof(BCInst)) return false;
+            fn.code.resize(ncode);
+            for(BCInst &inst : fn.code) if(!in.get(inst)) return false;
+        }
+        return in.cur == in.end && program.init >= 0 && program.entry >= 0 && (size_t)program.entry < nfuncs && (size_t)program.init < nfuncs && valid(program);
+    }
+
+    //先写入临时文件再改名，并发运行的进程不会读到写了一半的缓存
+    void store(const BCProgram &program) {
+        if(llvm::sys::fs::create_directories(mDir)) return;
+        int fd;
+        llvm::SmallString<128> tmp;
+        if(llvm::sys::fs::createUniqueFile(llvm::Twine(mPath) + ".tmp%%%%%%", fd, tmp)) return;
+        {
+            llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+            put<unsigned>(os, kMagic);
+            put<unsigned>(os, kVersion);
+            put(os, program.numGlobals);
+            put(os, program.init);
+            put(os, program.entry);
+            put<unsigned>(os, program.funcs.size());
+            for(const BCFunction &fn : program.funcs) {
+                put<unsigned>(os, fn.name.size());
+                os << fn.name;
+                put(os, fn.numParams);
+                put(os, fn.numRegs);
+                put(os, fn.arrayWords);
+                put<unsigned>(os, fn.code.size());
+                for(const BCInst &inst : fn.code) put(os, inst);
+            }
+            if(os.has_error()) {
+                os.clear_error();
+                llvm::sys::fs::remove(tmp);
+                return;
+            }
+        }
+        if(llvm::sys::fs::rename(tmp, mPath)) llvm::sys::fs::remove(tmp);
+    }
+};
+#endif /* !_BYTECODECACHE_H_ */
@@ -0,0 +1,682 @@
+//==--- Closure.h - 闭包编译执行 ----------------------------------------===//
+//
+// 把入口函数及其调用到的函数一次性编译为由专用节点组成的树，每种运算与
+// 操作数类型的组合各有一种节点（例如指针加整数与整数加整数，char数组与
+// int数组的读写），执行时每个
+// 节点只经过一次虚函数调用，不再做dyn_cast与类型判断。
+// 求值顺序与各结构的结果都与Environment一致，包括不支持的运算返回-1。
+// 节点树只读，可在多个线程中由各自的ClosureEngine同时执行。
+// 解释程序的调用使用本机栈：ClosureEngine在自己创建的线程上执行，栈的大小按栈预算设定，
+// 本机栈与栈帧合计超出预算时停止执行，调用深度因此与AST遍历器受同一个预算限制。
+//===----------------------------------------------------------------------===//
+#ifndef _CLOSURE_H_
+#define _CLOSURE_H_
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/Support/thread.h"
+
+#include "Environment.h"
+
+//一次运行的状态，由ClosureEngine持有，节点执行时读写
+struct ClosureContext {
+    long *frame; //当前函数的槽位
+    long *arrays; //当前函数的局部数组
+    long *globals;
+    Heap heap;
+    FrameArena arena; //栈帧与局部数组
+    InterpreterIO &io;
+    long ret; //当前函数的返回值
+    const char *stackBase; //执行线程的栈底，本机栈向低地址增长
+    size_t nativeLimit; //本机栈可用的字节数
+    size_t stackBudget; //本机栈与arena合计可用的字节数
+    bool stop; //超出栈预算后不再执行，各节点随即返回，不再产生副作用
+
+    explicit ClosureContext(InterpreterIO &io) : frame(NULL), arrays(NULL), globals(NULL), heap(), arena(), io(io), ret(0), stackBase(NULL), nativeLimit(0), stackBudget((size_t)1 << 30), stop(false) {}
+    //本机栈已用的字节数
+    size_t nativeBytes() const {
+        char probe;
+        return stackBase - &probe;
+    }
+};
+
+struct ClosureNode {
+    virtual ~ClosureNode() {}
+};
+//表达式节点，返回表达式的值
+struct CExpr : ClosureNode {
+    virtual long eval(ClosureContext &c) = 0;
+    //编译期判断是否为常量，用于选择右侧为常量的节点
+    virtual bool constant(long &value) const { return false; }
+};
+//语句节点，执行了return或需要停止时返回true，当前函数随即结束
+struct CStmt : ClosureNode {
+    virtual bool exec(ClosureContext &c) = 0;
+};
+
+struct ClosureFunction {
+    std::string name;
+    unsigned slots = 0; //参数在前，随后为局部变量
+    unsigned arrayWords = 0;
+    CStmt *body = NULL; //没有函数体时为NULL，调用返回0
+};
+
+struct ClosureProgram {
+    std::vector<std::unique_ptr<ClosureNode> > nodes;
+    std::vector<std::unique_ptr<ClosureFunction> > funcs;
+    unsigned numGlobals = 0;
+    CStmt *init = NULL; //全局变量的初始化
+    ClosureFunction *entry = NULL; //main
+};
+
+namespace closure {
+//二元运算，left与right已按先左后右的顺序求出
+struct Add { static long apply(long l, long r) { return l + r; } };
+struct Sub { static long apply(long l, long r) { return l - r; } };
+struct Mul { static long apply(long l, long r) { return l * r; } };
+struct Div { static long apply(long l, long r) { return l / r; } };
+struct Rem { static long apply(long l, long r) { return l % r; } };
+struct Gt { static long apply(long l, long r) { return l > r; } };
+struct Lt { static long apply(long l, long r) { return l < r; } };
+struct Eq { static long apply(long l, long r) { return l == r; } };
+struct Ge { static long apply(long l, long r) { return l >= r; } };
+struct Le { static long apply(long l, long r) { return l <= r; } };
+struct Ne { static long apply(long l, long r) { return l != r; } };
+
+//变量的存储位置
+struct Local {
+    unsigned index;
+    long &ref(ClosureContext &c) const { return c.frame[index]; }
+};
+struct Global {
+    unsigned index;
+    long &ref(ClosureContext &c) const { return c.globals[index]; }
+};
+
+class Const : public CExpr {
+    long mValue;
+public:
+    explicit Const(long value) : mValue(value) {}
+    virtual long eval(ClosureContext &c) { return mValue; }
+    virtual bool constant(long &value) const {
+        value = mValue;
+        return true;
+    }
+};
+template <class Var>
+class Load : public CExpr {
+    Var mVar;
+public:
+    explicit Load(Var var) : mVar(var) {}
+    virtual long eval(ClosureContext &c) { return mVar.ref(c); }
+};
+template <class Var>
+class Store : public CExpr {
+    Var mVar;
+    CExpr *mValue;
+public:
+    Store(Var var, CExpr *value) : mVar(var), mValue(value) {}
+    virtual long eval(ClosureContext &c) {
+        long val = mValue->eval(c);
+        mVar.ref(c) = val;
+        return val;
+    }
+};
+template <class Op>
+class Binary : public CExpr {
+    CExpr *mLeft, *mRight;
+public:
+    Binary(CExpr *left, CExpr *right) : mLeft(left), mRight(right) {}
+    virtual long eval(ClosureContext &c) {
+        long left = mLeft->eval(c), right = mRight->eval(c);
+        return c.stop ? 0 : Op::apply(left, right); //停止后右侧的调用返回0，不能再做除法
+    }
+};
+//右侧为常量，指针加减常量时常量已乘以所指类型的大小
+template <class Op>
+class BinaryConst : public CExpr {
+    CExpr *mLeft;
+    long mRight;
+public:
+    BinaryConst(CExpr *left, long right) : mLeft(left), mRight(right) {}
+    virtual long eval(ClosureContext &c) { return Op::apply(mLeft->eval(c), mRight); }
+};
+//指针加减整数，整数按所指类型的大小缩放
+template <class Op>
+class Scaled : public CExpr {
+    CExpr *mLeft, *mRight;
+    long mScale;
+public:
+    Scaled(CExpr *left, CExpr *right, long scale) : mLeft(left), mRight(right), mScale(scale) {}
+    virtual long eval(ClosureContext &c) {
+        long left = mLeft->eval(c);
+        return Op::apply(left, mRight->eval(c) * mScale);
+    }
+};
+//不支持的运算：求出各操作数后返回-1
+class Discard : public CExpr {
+    CExpr *mLeft, *mRight; //一元运算时mRight为NULL
+public:
+    Discard(CExpr *left, CExpr *right) : mLeft(left), mRight(right) {}
+    virtual long eval(ClosureContext &c) {
+        mLeft->eval(c);
+        if(mRight) mRight->eval(c);
+        return -1;
+    }
+};
+class Neg : public CExpr {
+    CExpr *mSub;
+public:
+    explicit Neg(CExpr *sub) : mSub(sub) {}
+    virtual long eval(ClosureContext &c) { return -mSub->eval(c); }
+};
+//经过堆检查的解引用，Elem为所指的元素类型
+template <class Elem>
+class HeapLoad : public CExpr {
+    CExpr *mAddr;
+public:
+    explicit HeapLoad(CExpr *addr) : mAddr(addr) {}
+    virtual long eval(ClosureContext &c) {
+        long addr = mAddr->eval(c);
+        return c.stop ? 0 : c.heap.GetAs<Elem>((char *)addr);
+    }
+};
+template <class Elem>
+class HeapStore : public CExpr {
+    CExpr *mAddr, *mValue;
+public:
+    HeapStore(CExpr *addr, CExpr *value) : mAddr(addr), mValue(value) {}
+    virtual long eval(ClosureContext &c) {
+        long addr = mAddr->eval(c), val = mValue->eval(c);
+        if(!c.stop) c.heap.UpdateAs<Elem>((char *)addr, val);
+        return val;
+    }
+};
+//数组元素：先求下标，再读数组变量
+template <class Elem, class Var>
+class ArrayLoad : public CExpr {
+    Var mBase;
+    CExpr *mIndex;
+public:
+    ArrayLoad(Var base, CExpr *index) : mBase(base), mIndex(index) {}
+    virtual long eval(ClosureContext &c) {
+        long index = mIndex->eval(c);
+        if(c.stop) return 0;
+        return loadAs<Elem>((char *)mBase.ref(c) + index * (long)sizeof(Elem));
+    }
+};
+template <class Elem, class Var>
+class ArrayStore : public CExpr {
+    Var mBase;
+    CExpr *mIndex, *mValue;
+public:
+    ArrayStore(Var base, CExpr *index, CExpr *value) : mBase(base), mIndex(index), mValue(value) {}
+    virtual long eval(ClosureContext &c) {
+        long index = mIndex->eval(c), val = mValue->eval(c);
+        if(!c.stop) storeAs<Elem>((char *)mBase.ref(c) + index * (long)sizeof(Elem), val);
+        return val;
+    }
+};
+//局部数组指向栈帧数组区中的固定偏移
+class LocalArray : public CExpr {
+    unsigned mIndex, mOffset;
+public:
+    LocalArray(unsigned index, unsigned offset) : mIndex(index), mOffset(offset) {}
+    virtual long eval(ClosureContext &c) { return c.frame[mIndex] = (long)(c.arrays + mOffset); }
+};
+class GlobalArray : public CExpr {
+    unsigned mIndex, mWords;
+public:
+    GlobalArray(unsigned index, unsigned words) : mIndex(index), mWords(words) {}
+    virtual long eval(ClosureContext &c) { return c.globals[mIndex] = (long)c.arena.alloc(mWords); }
+};
+
+class Get : public CExpr {
+public:
+    virtual long eval(ClosureContext &c) { return c.stop ? 0 : c.io.get(); }
+};
+class Print : public CExpr {
+    CExpr *mValue;
+public:
+    explicit Print(CExpr *value) : mValue(value) {}
+    virtual long eval(ClosureContext &c) {
+        long val = mValue->eval(c);
+        if(!c.stop) c.io.print(val); //停止后所在语句的其余部分不再产生输出
+        return 0;
+    }
+};
+class Malloc : public CExpr {
+    CExpr *mSize;
+public:
+    explicit Malloc(CExpr *size) : mSize(size) {}
+    virtual long eval(ClosureContext &c) {
+        long size = mSize->eval(c);
+        return c.stop ? 0 : (long)c.heap.Malloc(size);
+    }
+};
+class Free : public CExpr {
+    CExpr *mAddr;
+public:
+    explicit Free(CExpr *addr) : mAddr(addr) {}
+    virtual long eval(ClosureContext &c) {
+        long addr = mAddr->eval(c);
+        if(!c.stop) c.heap.Free((long *)addr);
+        return 0;
+    }
+};
+//用户函数调用：实参直接求值到新栈帧的前几个槽位，其余槽位为0
+class Call : public CExpr {
+    const ClosureFunction *mFunc;
+    std::vector<CExpr *> mArgs;
+public:
+    Call(const ClosureFunction *func, std::vector<CExpr *> args) : mFunc(func), mArgs(std::move(args)) {}
+    virtual long eval(ClosureContext &c) {
+        size_t slots = std::max<size_t>(mFunc->slots, mArgs.size());
+        FrameArena::Mark mark = c.arena.mark();
+        long *frame = c.arena.alloc(slots + mFunc->arrayWords);
+        std::fill(frame, frame + slots, 0);
+        for(size_t i = 0; i < mArgs.size(); i++) frame[i] = mArgs[i]->eval(c);
+        long ret = 0;
+        if(c.stop || !mFunc->body) {
+        } else if(c.nativeBytes() > c.nativeLimit || c.nativeBytes() + c.arena.bytes() > c.stackBudget) { //停止执行，各层调用随即返回
+            llvm::errs() << "error: call to '" << mFunc->name << "' exceeds the closure engine's stack budget of " << c.stackBudget << " bytes\n";
+            c.stop = true;
+        } else {
+            long *callerFrame = c.frame, *callerArrays = c.arrays;
+            c.frame = frame;
+            c.arrays = frame + slots;
+            if(mFunc->body->exec(c)) ret = c.ret; //执行到函数末尾时返回0
+            c.frame = callerFrame;
+            c.arrays = callerArrays;
+        }
+        c.arena.release(mark);
+        return ret;
+    }
+};
+
+class Nop : public CStmt {
+public:
+    virtual bool exec(ClosureContext &c) { return false; }
+};
+class Block : public CStmt {
+    std::vector<CStmt *> mStmts;
+public:
+    explicit Block(std::vector<CStmt *> stmts) : mStmts(std::move(stmts)) {}
+    virtual bool exec(ClosureContext &c) {
+        for(CStmt *s : mStmts) if(s->exec(c)) return true;
+        return false;
+    }
+};
+class ExprStmt : public CStmt {
+    CExpr *mExpr;
+public:
+    explicit ExprStmt(CExpr *e) : mExpr(e) {}
+    virtual bool exec(ClosureContext &c) {
+        mExpr->eval(c);
+        return c.stop;
+    }
+};
+class If : public CStmt {
+    CExpr *mCond;
+    CStmt *mThen, *mElse;
+public:
+    If(CExpr *cond, CStmt *then, CStmt *other) : mCond(cond), mThen(then), mElse(other) {}
+    virtual bool exec(ClosureContext &c) {
+        long cond = mCond->eval(c);
+        if(c.stop) return true;
+        return cond ? mThen->exec(c) : mElse->exec(c);
+    }
+};
+class While : public CStmt {
+    CExpr *mCond;
+    CStmt *mBody;
+public:
+    While(CExpr *cond, CStmt *body) : mCond(cond), mBody(body) {}
+    virtual bool exec(ClosureContext &c) {
+        while(mCond->eval(c) && !c.stop) if(mBody->exec(c)) return true;
+        return c.stop;
+    }
+};
+class For : public CStmt {
+    CStmt *mInit;
+    CExpr *mCond, *mInc;
+    CStmt *mBody;
+public:
+    For(CStmt *init, CExpr *cond, CExpr *inc, CStmt *body) : mInit(init), mCond(cond), mInc(inc), mBody(body) {}
+    virtual bool exec(ClosureContext &c) {
+        if(mInit->exec(c)) return true;
+        for(; mCond->eval(c) && !c.stop; mInc->eval(c)) if(mBody->exec(c)) return true;
+        return c.stop;
+    }
+};
+class Return : public CStmt {
+    CExpr *mValue;
+public:
+    explicit Return(CExpr *value) : mValue(value) {}
+    virtual bool exec(ClosureContext &c) {
+        c.ret = mValue->eval(c);
+        return true;
+    }
+};
+class ReturnVoid : public CStmt {
+public:
+    virtual bool exec(ClosureContext &c) {
+        c.ret = 0;
+        return true;
+    }
+};
+} // namespace closure
+
+//把AST编译为节点树，遇到AST遍历器会出错的结构时返回false，由调用者回退到AST遍历
+class ClosureCompiler {
+    ClosureProgram &mProg;
+    ASTContext *mContext;
+    FunctionDecl *mFree, *mMalloc, *mInput, *mOutput;
+    std::map<FunctionDecl *, ClosureFunction *> mFuncs; //规范声明 -> 函数
+    std::vector<std::pair<FunctionDecl *, ClosureFunction *> > mPending; //待编译的函数
+    std::map<VarDecl *, VarSlot> mVars; //全局变量与当前函数的局部变量
+    CStmt *mNop;
+    bool mOk;
+
+    template <class T, class... Args>
+    T *make(Args &&... args) {
+        T *node = new T(std::forward<Args>(args)...);
+        mProg.nodes.push_back(std::unique_ptr<ClosureNode>(node));
+        return node;
+    }
+    CExpr *fail() {
+        mOk = false;
+        return make<closure::Const>(0);
+    }
+    ClosureFunction *function(FunctionDecl *fd) {
+        FunctionDecl *canon = fd->getCanonicalDecl();
+        ClosureFunction *&fn = mFuncs[canon];
+        if(fn) return fn;
+        mProg.funcs.push_back(std::unique_ptr<ClosureFunction>(new ClosureFunction()));
+        fn = mProg.funcs.back().get();
+        fn->name = fd->getNameAsString();
+        if(FunctionDecl *def = fd->getDefinition()) mPending.push_back(std::make_pair(def, fn));
+        return fn;
+    }
+    const VarSlot *slot(Decl *decl) {
+        VarDecl *vd = dyn_cast<VarDecl>(decl);
+        std::map<VarDecl *, VarSlot>::iterator it = vd ? mVars.find(vd) : mVars.end();
+        return it == mVars.end() ? NULL : &it->second;
+    }
+    //按变量是局部还是全局选择节点类型
+    template <template <class> class Node, class... Args>
+    CExpr *var(Decl *decl, Args... args) {
+        const VarSlot *s = slot(decl);
+        if(!s) return fail();
+        if(s->global) return make<Node<closure::Global> >(closure::Global{s->index}, args...);
+        return make<Node<closure::Local> >(closure::Local{s->index}, args...);
+    }
+    //数组元素节点Node<Elem, Var>：按数组变量是局部还是全局选择Var
+    template <template <class, class> class Node, class Elem, class... Args>
+    CExpr *arrayVar(Decl *decl, Args... args) {
+        const VarSlot *s = slot(decl);
+        if(!s) return fail();
+        if(s->global) return make<Node<Elem, closure::Global> >(closure::Global{s->index}, args...);
+        return make<Node<Elem, closure::Local> >(closure::Local{s->index}, args...);
+    }
+    //按元素类型选择Elem
+    template <template <class, class> class Node, class... Args>
+    CExpr *array(QualType elem, Decl *decl, Args... args) {
+        MemType type = Environment::memTypeOf(*mContext, elem);
+        switch(type.size) {
+            case 1: return type.isSigned ? arrayVar<Node, signed char>(decl, args...) : arrayVar<Node, unsigned char>(decl, args...);
+            case 2: return type.isSigned ? arrayVar<Node, short>(decl, args...) : arrayVar<Node, unsigned short>(decl, args...);
+            case 4: return type.isSigned ? arrayVar<Node, int>(decl, args...) : arrayVar<Node, unsigned int>(decl, args...);
+            default: return arrayVar<Node, long>(decl, args...);
+        }
+    }
+    template <template <class> class Node, class... Args>
+    CExpr *heap(QualType elem, Args... args) {
+        MemType type = Environment::memTypeOf(*mContext, elem);
+        switch(type.size) {
+            case 1: return type.isSigned ? make<Node<signed char> >(args...) : make<Node<unsigned char> >(args...);
+            case 2: return type.isSigned ? make<Node<short> >(args...) : make<Node<unsigned short> >(args...);
+            case 4: return type.isSigned ? make<Node<int> >(args...) : make<Node<unsigned int> >(args...);
+            default: return make<Node<long> >(args...);
+        }
+    }
+    CExpr *constant(long value) { return make<closure::Const>(value); }
+
+    //与Environment::vardecl一致：整数、字符和指针求初值，数组分配空间，其余为0
+    CExpr *vardecl(VarDecl *vd) {
+        const VarSlot *s = slot(vd);
+        if(!s) return fail();
+        if(Environment::hasScalarInit(vd)) return var<closure::Store>(vd, expr(vd->getInit()));
+        if(isa<ConstantArrayType>(vd->getType().getTypePtr())) {
+            if(s->global) return make<closure::GlobalArray>(s->index, Environment::wordsOf(*mContext, vd->getType()));
+            return make<closure::LocalArray>(s->index, s->array);
+        }
+        if(vd->getType()->isArrayType()) return fail();
+        return var<closure::Store>(vd, constant(0));
+    }
+    //赋值时先求左侧的下标或地址，再求右侧的值；复合赋值与普通赋值相同
+    CExpr *assignment(BinaryOperator *bop) {
+        Expr *left = bop->getLHS(), *right = bop->getRHS();
+        if(DeclRefExpr *i = dyn_cast<DeclRefExpr>(left)) {
+            return var<closure::Store>(i->getDecl(), expr(right));
+        } else if(ArraySubscriptExpr *i = dyn_cast<ArraySubscriptExpr>(left)) {
+            DeclRefExpr *base = dyn_cast<DeclRefExpr>(i->getLHS()->IgnoreImpCasts());
+            if(!base) return fail();
+            CExpr *index = expr(i->getIdx());
+            return array<closure::ArrayStore>(i->getType(), base->getDecl(), index, expr(right));
+        } else if(UnaryOperator *i = dyn_cast<UnaryOperator>(left)) {
+            CExpr *addr = expr(i->getSubExpr());
+            return heap<closure::HeapStore>(i->getType(), addr, expr(right));
+        }
+        return expr(right);
+    }
+    template <class Op>
+    CExpr *arith(CExpr *left, CExpr *right) {
+        long k;
+        if(right->constant(k)) return make<closure::BinaryConst<Op> >(left, k);
+        return make<closure::Binary<Op> >(left, right);
+    }
+    CExpr *binop(BinaryOperator *bop) {
+        if(bop->isAssignmentOp()) return assignment(bop);
+        CExpr *left = expr(bop->getLHS());
+        CExpr *right = expr(bop->getRHS());
+        switch(bop->getOpcode()) {
+            case BO_GT: return arith<closure::Gt>(left, right);
+            case BO_LT: return arith<closure::Lt>(left, right);
+            case BO_EQ: return arith<closure::Eq>(left, right);
+            case BO_GE: return arith<closure::Ge>(left, right);
+            case BO_LE: return arith<closure::Le>(left, right);
+            case BO_NE: return arith<closure::Ne>(left, right);
+            case BO_Mul: return arith<closure::Mul>(left, right);
+            case BO_Div: return arith<closure::Div>(left, right);
+            case BO_Rem: return arith<closure::Rem>(left, right);
+            case BO_Add: case BO_Sub: {
+                bool add = bop->getOpcode() == BO_Add;
+                if(long scale = Environment::scaleOf(*mContext, bop)) { //指针加减整数
+                    long k;
+                    if(right->constant(k)) {
+                        long offset = k * scale;
+                        if(add) return make<closure::BinaryConst<closure::Add> >(left, offset);
+                        return make<closure::BinaryConst<closure::Sub> >(left, offset);
+                    }
+                    if(add) return make<closure::Scaled<closure::Add> >(left, right, scale);
+                    return make<closure::Scaled<closure::Sub> >(left, right, scale);
+                }
+                return add ? arith<closure::Add>(left, right) : arith<closure::Sub>(left, right);
+            }
+            default: return make<closure::Discard>(left, right);
+        }
+    }
+    CExpr *unaryop(UnaryOperator *uop) {
+        CExpr *sub = expr(uop->getSubExpr());
+        switch(uop->getOpcode()) {
+            case UO_Plus: return sub;
+            case UO_Minus: return make<closure::Neg>(sub);
+            case UO_Deref: return heap<closure::HeapLoad>(uop->getType(), sub);
+            default: return make<closure::Discard>(sub, (CExpr *)NULL);
+        }
+    }
+    CExpr *call(CallExpr *callexpr) {
+        FunctionDecl *callee = callexpr->getDirectCallee();
+        if(!callee) return fail();
+        if(callee == mInput) return make<closure::Get>();
+        if(callee == mOutput) return make<closure::Print>(expr(callexpr->getArg(0)));
+        if(callee == mMalloc) return make<closure::Malloc>(expr(callexpr->getArg(0)));
+        if(callee == mFree) return make<closure::Free>(expr(callexpr->getArg(0)));
+        std::vector<CExpr *> args;
+        for(unsigned i = 0; i < callexpr->getNumArgs(); i++) args.push_back(expr(callexpr->getArg(i)));
+        return make<closure::Call>(function(callee), std::move(args));
+    }
+    CExpr *expr(Expr *exp) {
+        if(!mOk) return constant(0);
+        Expr *e = Environment::strip(exp);
+        if(IntegerLiteral *i = dyn_cast<IntegerLiteral>(e)) {
+            return constant((long)i->getValue().getSExtValue());
+        } else if(CharacterLiteral *i = dyn_cast<CharacterLiteral>(e)) {
+            return constant(i->getValue());
+        } else if(DeclRefExpr *i = dyn_cast<DeclRefExpr>(e)) {
+            return var<closure::Load>(i->getDecl());
+        } else if(UnaryExprOrTypeTraitExpr *i = dyn_cast<UnaryExprOrTypeTraitExpr>(e)) {
+            return constant(Environment::sizeofexpr(*mContext, i));
+        } else if(BinaryOperator *i = dyn_cast<BinaryOperator>(e)) {
+            return binop(i);
+        } else if(UnaryOperator *i = dyn_cast<UnaryOperator>(e)) {
+            return unaryop(i);
+        } else if(ArraySubscriptExpr *i = dyn_cast<ArraySubscriptExpr>(e)) {
+            DeclRefExpr *base = dyn_cast<DeclRefExpr>(i->getLHS()->IgnoreImpCasts());
+            if(!base) return fail();
+            return array<closure::ArrayLoad>(i->getType(), base->getDecl(), expr(i->getIdx()));
+        } else if(CallExpr *i = dyn_cast<CallExpr>(e)) {
+            return call(i);
+        }
+        return constant(-1); //其他表达式不求值
+    }
+    CStmt *stmt(Stmt *s) {
+        if(!mOk || !s) return mNop;
+        if(Expr *e = dyn_cast<Expr>(s)) {
+            return make<closure::ExprStmt>(expr(e));
+        } else if(CompoundStmt *block = dyn_cast<CompoundStmt>(s)) {
+            std::vector<CStmt *> stmts;
+            for(Stmt *child : block->body()) stmts.push_back(stmt(child));
+            return make<closure::Block>(std::move(stmts));
+        } else if(DeclStmt *ds = dyn_cast<DeclStmt>(s)) {
+            std::vector<CStmt *> stmts;
+            for(DeclStmt::decl_iterator it = ds->decl_begin(), ie = ds->decl_end(); it != ie; ++it)
+                if(VarDecl *vd = dyn_cast<VarDecl>(*it)) stmts.push_back(make<closure::ExprStmt>(vardecl(vd)));
+            return make<closure::Block>(std::move(stmts));
+        } else if(ReturnStmt *rs = dyn_cast<ReturnStmt>(s)) {
+            if(rs->getRetValue()) return make<closure::Return>(expr(rs->getRetValue()));
+            return make<closure::ReturnVoid>();
+        } else if(WhileStmt *ws = dyn_cast<WhileStmt>(s)) {
+            CExpr *cond = expr(ws->getCond());
+            return make<closure::While>(cond, stmt(ws->getBody()));
+        } else if(ForStmt *fs = dyn_cast<ForStmt>(s)) {
+            CStmt *init = stmt(fs->getInit());
+            CExpr *cond = fs->getCond() ? expr(fs->getCond()) : constant(1);
+            CExpr *inc = fs->getInc() ? expr(fs->getInc()) : constant(0);
+            return make<closure::For>(init, cond, inc, stmt(fs->getBody()));
+        } else if(IfStmt *is = dyn_cast<IfStmt>(s)) {
+            CExpr *cond = expr(is->getCond());
+            CStmt *then = stmt(is->getThen());
+            return make<closure::If>(cond, then, stmt(is->getElse()));
+        }
+        std::vector<CStmt *> stmts; //其他语句依次执行其子语句
+        for(Stmt *child : s->children()) if(child) stmts.push_back(stmt(child));
+        if(stmts.empty()) return mNop;
+        return make<closure::Block>(std::move(stmts));
+    }
+    //与Environment::resolve相同的槽位分配：参数在前，数组按声明依次排在数组区
+    void define(FunctionDecl *def, ClosureFunction *fn) {
+        std::map<VarDecl *, int> locals;
+        for(unsigned i = 0; i < def->getNumParams(); i++) locals[def->getParamDecl(i)] = i;
+        LocalCollector(locals).TraverseStmt(def->getBody());
+        std::map<VarDecl *, VarSlot> globals;
+        for(auto &v : mVars) if(v.second.global) globals.insert(v);
+        mVars.swap(globals);
+        fn->slots = locals.size();
+        for(auto &local : locals) {
+            mVars[local.first] = VarSlot{(unsigned)local.second, false, fn->arrayWords};
+            if(isa<ConstantArrayType>(local.first->getType().getTypePtr()))
+                fn->arrayWords += Environment::wordsOf(*mContext, local.first->getType());
+        }
+        fn->body = stmt(def->getBody());
+    }
+
+public:
+    explicit ClosureCompiler(ClosureProgram &prog) : mProg(prog), mContext(NULL), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL), mNop(NULL), mOk(true) {}
+    bool compile(TranslationUnitDecl *unit) {
+        mContext = &unit->getASTContext();
+        mNop = make<closure::Nop>();
+        FunctionDecl *entry = NULL;
+        std::vector<CStmt *> init;
+        for(TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i) {
+            if(VarDecl *vdecl = dyn_cast<VarDecl>(*i)) { //全局变量按声明顺序初始化
+                mVars[vdecl] = VarSlot{mProg.numGlobals++, true, 0};
+                init.push_back(make<closure::ExprStmt>(vardecl(vdecl)));
+            } else if(FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i)) {
+                if(fdecl->getName().equals("FREE")) mFree = fdecl;
+                else if(fdecl->getName().equals("MALLOC")) mMalloc = fdecl;
+                else if(fdecl->getName().equals("GET")) mInput = fdecl;
+                else if(fdecl->getName().equals("PRINT")) mOutput = fdecl;
+                else if(fdecl->getName().equals("main")) entry = fdecl;
+            }
+        }
+        mProg.init = make<closure::Block>(std::move(init));
+        if(!entry || !entry->hasBody() || !mOk) return false;
+        mProg.entry = function(entry);
+        while(!mPending.empty() && mOk) {
+            std::pair<FunctionDecl *, ClosureFunction *> next = mPending.back();
+            mPending.pop_back();
+            define(next.first, next.second);
+        }
+        return mOk;
+    }
+};
+
+//执行编译好的节点树，每次运行各用一份
+class ClosureEngine {
+    const ClosureProgram &mProg;
+    std::vector<long> mGlobals;
+    ClosureContext mCtx;
+
+public:
+    //本机栈在两次检查之间还可能用到的字节数：一个函数体内的嵌套求值与报错
+    enum : size_t { kStackMargin = (size_t)1 << 20 };
+    //llvm::thread的栈大小为unsigned
+    enum : size_t { kMaxStack = (size_t)1 << 31 };
+
+    //先初始化全局变量再执行main
+    bool execute() {
+        mProg.init->exec(mCtx);
+        const ClosureFunction *main = mProg.entry;
+        if(mCtx.stop || !main->body) return !mCtx.stop;
+        mCtx.frame = mCtx.arena.alloc(main->slots + main->arrayWords);
+        std::fill(mCtx.frame, mCtx.frame + main->slots, 0);
+        mCtx.arrays = mCtx.frame + main->slots;
+        main->body->exec(mCtx);
+        return !mCtx.stop;
+    }
+
+public:
+    ClosureEngine(const ClosureProgram &prog, InterpreterIO &io) : mProg(prog), mGlobals(prog.numGlobals), mCtx(io) { mCtx.globals = mGlobals.data(); }
+    void setStackBudget(size_t bytes) { mCtx.stackBudget = bytes; }
+    //在栈大小由预算决定的新线程上执行，调用线程（例如线程池中的线程）的栈大小无关紧要。
+    //超出栈预算时返回false
+    bool run() {
+        size_t native = std::min<size_t>(mCtx.stackBudget, kMaxStack - kStackMargin);
+        bool ok = true;
+        llvm::thread worker(llvm::Optional<unsigned>((unsigned)(native + kStackMargin)), [this, native, &ok] {
+            char base;
+            mCtx.stackBase = &base;
+            mCtx.nativeLimit = native;
+            ok = execute();
+        });
+        worker.join();
+        return ok;
+    }
+};
+#endif /* !_CLOSURE_H_ */
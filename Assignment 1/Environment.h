@@ -1,7 +1,10 @@
 //==--- tools/clang-check/ClangInterpreter.cpp - Clang Interpreter tool
 //--------------===//
 //===----------------------------------------------------------------------===//
+#ifndef _ENVIRONMENT_H_
+#define _ENVIRONMENT_H_
 #include <stdio.h>
+#include <algorithm>
 
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/Decl.h"
@@ -9,37 +12,92 @@
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/DenseMap.h"
+
+#include "Heap.h"
+#include "IO.h"
+#include "Profiler.h"
 
 using namespace clang;
 
-//栈，存储声明和语句，以及当前语句的相关信息
+//变量槽位，全局变量下标对应Environment::mGlobals，局部变量下标相对于所在栈帧的起点
+//局部数组另外记录其在栈帧数组区中的偏移（以long为单位），数组元素按实际大小紧凑排列
+struct VarSlot {
+    unsigned index;
+    bool global;
+    unsigned array;
+};
+
+//函数栈帧的布局：槽位数以及全部局部数组占用的空间
+struct FrameLayout {
+    unsigned slots;
+    unsigned arrayWords;
+};
+
+//收集函数体内所有局部变量声明，依次分配槽位
+class LocalCollector : public RecursiveASTVisitor<LocalCollector> {
+    std::map<VarDecl *, int> &mSlots;
+public:
+    explicit LocalCollector(std::map<VarDecl *, int> &slots) : mSlots(slots) {}
+    bool VisitVarDecl(VarDecl *vd) {
+        if(mSlots.find(vd) == mSlots.end()) {
+            int slot = mSlots.size();
+            mSlots[vd] = slot;
+        }
+        return true;
+    }
+};
+
+//运行时用到的类型大小，在解释执行前一次求出。ASTContext求类型大小时会写入它内部的缓存，
+//不能在-inputs的多个线程中同时调用；求好后只读，可由多个Environment共享
+struct TypeLayout {
+    llvm::DenseMap<Expr *, MemType> memTypes; //数组下标与解引用表达式 -> 读写的元素类型
+    llvm::DenseMap<BinaryOperator *, long> scales; //指针加减整数 -> 整数的缩放倍数
+    llvm::DenseMap<Expr *, long> sizes; //sizeof表达式 -> 值
+    llvm::DenseMap<VarDecl *, unsigned> arrayWords; //数组变量 -> 占用的long个数
+};
+
+//续体：尚未执行完的语句或表达式，step记录已经完成到哪一步
+//node为NULL的续体表示丢弃值栈顶的一个值（表达式语句的结果）
+struct Continuation {
+    Stmt *node;
+    unsigned step;
+};
+
+//分层执行的编译层，由Jit.h实现，返回NULL时继续解释执行
+class JitTier {
+public:
+    //args至少有被调函数形参个数那么多个值
+    typedef long (*FunctionEntry)(long *args);
+    //从循环主体开始执行到循环结束，执行了return时把返回值写入ret并返回1
+    typedef long (*LoopEntry)(long *slots, long *arrays, long *ret);
+    virtual ~JitTier() {}
+    //每次调用用户函数时询问，调用次数达到阈值后编译
+    virtual FunctionEntry function(FunctionDecl *callee) = 0;
+    //每次循环条件成立时询问，回边次数达到阈值后编译
+    virtual LoopEntry loop(Stmt *loop) = 0;
+};
+
+//栈，存储当前函数的槽位起点、局部数组、返回值以及当前语句
 class StackFrame {
-    /// StackFrame maps Variable Declaration to Value
+    /// Variables of the frame live in Environment::mSlots starting at mBase
     /// Which are either integer or addresses (also represented using an Integer value)
-    std::map<Decl *, long> mVars; //存储声明
-    std::map<Stmt *, long> mExprs; //存储计算语句的值，也包括常数
+    size_t mBase; //局部变量在mSlots中的起点
+    long *mArrays; //局部数组在FrameArena中的起点
+    FrameArena::Mark mArenaMark; //返回时FrameArena退回的位置
+    size_t mContBase; //函数体的续体在续体栈中的起点，return时退回到这里
+    size_t mValueBase; //进入函数时值栈的高度
     Stmt *mPC; //当前语句
     long retValue = 0; //返回地址
     bool returned = false; //是否返回
 
 public:
-    StackFrame() : mVars(), mExprs(), mPC() {} //构造函数，初始化成员参数
-    //约束声明decl的值为val
-    void bindDecl(Decl *decl, long val) { mVars[decl] = val; }
-    //返回声明decl的值
-    long getDeclVal(Decl *decl) {
-        assert(mVars.find(decl) != mVars.end());
-        return mVars.find(decl)->second;
-    }
-    bool findDecl(Decl *decl) { return mVars.find(decl) != mVars.end(); }
-    //关于mExprs
-    //约束语句stmt的值为val
-    void bindStmt(Stmt *stmt, long val) { mExprs[stmt] = val; }
-    //返回stmt的值，包含<stmt, val>
-    long getStmtVal(Stmt *stmt) {
-        assert(mExprs.find(stmt) != mExprs.end());
-        return mExprs[stmt];
-    }
+    explicit StackFrame(size_t base = 0, long *arrays = NULL, FrameArena::Mark mark = FrameArena::Mark(), size_t contBase = 0, size_t valueBase = 0) : mBase(base), mArrays(arrays), mArenaMark(mark), mContBase(contBase), mValueBase(valueBase), mPC() {} //构造函数，初始化成员参数
+    size_t getBase() { return mBase; }
+    long *getArrays() { return mArrays; }
+    FrameArena::Mark getArenaMark() { return mArenaMark; }
+    size_t getContBase() { return mContBase; }
+    size_t getValueBase() { return mValueBase; }
     void setPC(Stmt *stmt) { mPC = stmt; }
     Stmt *getPC() { return mPC; }
     long getRetValue() { return retValue; }
@@ -48,239 +106,488 @@ public:
     bool isReturned() { return returned; }
 };
 
-//堆，存储了常用的调用函数
-class Heap {
-    std::map<long *, int> block; //存储已经申请空间的数据块，左为地址，右为大小size
-public:
-    long *Malloc(int size) {
-        long *addr = (long *)malloc(size);
-        block[addr] = size;
-        return addr;
-    }
-    void Free(long *addr) { if(block.find(addr) != block.end()) free(addr); }
-    void Update(long *addr, long val) { for(auto &i : block) if((long)addr >= (long)(i.first) && (long)addr <= (long)(i.first+i.second)) *addr = val; }
-    long Get(long *addr) {
-        for(auto &i : block) if((long)addr >= (long)(i.first) && (long)addr <= (long)(i.first+i.second)) return *addr;
-        return -1;
-    }
-};
-
 //环境类，包含各种操作的实现
+//语句和表达式都在显式的续体栈与值栈上执行，解释程序的调用深度不占用本机栈，
+//只受mStackBudget限制。栈帧、槽位、续体和值都存放在只增不缩的vector中，
+//返回后留下的空间由之后的调用原地复用
 class Environment {
     std::vector<StackFrame> mStack; //栈
-    Heap *mHeap; //堆
+    std::vector<long> mSlots; //所有活动栈帧的变量连续存放
+    std::vector<long> mGlobals; //全局变量
+    std::vector<Continuation> mConts; //续体栈
+    std::vector<long> mValues; //表达式的中间结果
+    llvm::DenseMap<Decl *, VarSlot> mVarSlots; //变量声明 -> 槽位
+    llvm::DenseMap<FunctionDecl *, FrameLayout> mFrameLayout; //函数规范声明 -> 栈帧布局
+    const TypeLayout *mLayout; //未调用setLayout时指向mOwnLayout
+    TypeLayout mOwnLayout;
+    Heap mHeap; //堆，每个Environment独占，可在不同线程中同时运行
+    FrameArena mArena; //局部数组与全局数组
+    InterpreterIO *mIO; //GET与PRINT的输入输出
+    Profiler *mProf; //未开启剖析时为NULL
+    JitTier *mJit; //未开启分层执行时为NULL
+    size_t mStackBudget; //栈帧、槽位、续体、值与局部数组合计可用的字节数
+    bool mOverflow; //超出mStackBudget后停止执行
     FunctionDecl *mFree;  /// Declartions to the built-in functions
     FunctionDecl *mMalloc;
     FunctionDecl *mInput;
     FunctionDecl *mOutput;
     FunctionDecl *mEntry;
 
+    long pop() {
+        long val = mValues.back();
+        mValues.pop_back();
+        return val;
+    }
+    size_t stackBytes() {
+        return (mSlots.size() + mValues.size()) * sizeof(long) + mStack.size() * sizeof(StackFrame) + mConts.size() * sizeof(Continuation) + mArena.bytes();
+    }
+    //压入表达式，常量与变量直接求值，其余的留给execute
+    void pushExpr(Expr *exp) {
+        Expr *e = strip(exp);
+        if(IntegerLiteral *i = dyn_cast<IntegerLiteral>(e)) { //整数型常量
+            mValues.push_back((long)i->getValue().getSExtValue());
+        } else if(CharacterLiteral *i = dyn_cast<CharacterLiteral>(e)) { //字符型常量
+            mValues.push_back(i->getValue());
+        } else if(DeclRefExpr *i = dyn_cast<DeclRefExpr>(e)) { //引用已有变量
+            mValues.push_back(declref(i));
+        } else if(UnaryExprOrTypeTraitExpr *i = dyn_cast<UnaryExprOrTypeTraitExpr>(e)) {
+            mValues.push_back(mLayout->sizes.lookup(i));
+        } else if(isa<BinaryOperator>(e) || isa<CallExpr>(e) || isa<UnaryOperator>(e) || isa<ArraySubscriptExpr>(e)) {
+            mConts.push_back(Continuation{e, 0});
+        } else mValues.push_back(-1);
+    }
+    //压入语句，表达式语句的结果随后丢弃
+    void pushStmt(Stmt *stmt) {
+        if(mProf && !isa<CompoundStmt>(stmt)) mProf->stmt(stmt);
+        if(Expr *e = dyn_cast<Expr>(stmt)) {
+            mConts.push_back(Continuation{NULL, 0});
+            pushExpr(e);
+        } else mConts.push_back(Continuation{stmt, 0});
+    }
+    //执行续体栈直到其高度回到base
+    void execute(size_t base) {
+        while(mConts.size() > base) {
+            Continuation &k = mConts.back();
+            Stmt *node = k.node;
+            unsigned step = k.step++; //之后可能压栈，k不再有效
+            if(!node) {
+                mConts.pop_back();
+                mValues.pop_back();
+            } else if(BinaryOperator *bop = dyn_cast<BinaryOperator>(node)) {
+                binop(bop, step);
+            } else if(UnaryOperator *uop = dyn_cast<UnaryOperator>(node)) {
+                if(step == 0) {
+                    pushExpr(uop->getSubExpr());
+                } else {
+                    mConts.pop_back();
+                    mValues.back() = unaryop(uop, mValues.back());
+                }
+            } else if(ArraySubscriptExpr *aexpr = dyn_cast<ArraySubscriptExpr>(node)) {
+                if(step == 0) {
+                    pushExpr(aexpr->getIdx());
+                } else {
+                    mConts.pop_back();
+                    mValues.back() = arrayref(aexpr, mValues.back());
+                }
+            } else if(CallExpr *callexpr = dyn_cast<CallExpr>(node)) {
+                call(callexpr, step);
+            } else if(CompoundStmt *block = dyn_cast<CompoundStmt>(node)) {
+                if(step < block->size()) pushStmt(block->body_begin()[step]);
+                else mConts.pop_back();
+            } else if(DeclStmt *ds = dyn_cast<DeclStmt>(node)) {
+                decl(ds, step);
+            } else if(ReturnStmt *rstmt = dyn_cast<ReturnStmt>(node)) {
+                if(step == 0 && rstmt->getRetValue()) pushExpr(rstmt->getRetValue());
+                else retstmt(rstmt);
+            } else if(WhileStmt *whilestmt = dyn_cast<WhileStmt>(node)) {
+                //0：进入循环 1：求条件 2：条件成立时执行主体
+                if(step == 0) {
+                    if(mProf) mProf->loopEntry(whilestmt);
+                } else if(step == 1) {
+                    pushExpr(whilestmt->getCond());
+                } else if(!pop()) {
+                    mConts.pop_back();
+                } else if(!enterNativeLoop(whilestmt)) {
+                    if(mProf) mProf->loopTrip(whilestmt);
+                    mConts.back().step = 1;
+                    pushStmt(whilestmt->getBody());
+                }
+            } else if(ForStmt *forstmt = dyn_cast<ForStmt>(node)) {
+                //0：初始化 1：求条件 2：条件成立时执行主体 3：自增
+                if(step == 0) {
+                    if(forstmt->getInit()) pushStmt(forstmt->getInit());
+                    if(mProf) mProf->loopEntry(forstmt);
+                } else if(step == 1) {
+                    if(forstmt->getCond()) pushExpr(forstmt->getCond());
+                    else mValues.push_back(1);
+                } else if(step == 2) {
+                    if(!pop()) {
+                        mConts.pop_back();
+                    } else if(!enterNativeLoop(forstmt)) {
+                        if(mProf) mProf->loopTrip(forstmt);
+                        pushStmt(forstmt->getBody()); //先主体部分，后inc
+                    }
+                } else {
+                    mConts.back().step = 1;
+                    if(forstmt->getInc()) pushStmt(forstmt->getInc());
+                }
+            } else if(IfStmt *ifstmt = dyn_cast<IfStmt>(node)) {
+                if(step == 0) {
+                    pushExpr(ifstmt->getCond());
+                } else {
+                    mConts.pop_back();
+                    if(pop()) pushStmt(ifstmt->getThen());
+                    else if(ifstmt->getElse()) pushStmt(ifstmt->getElse()); //访问false分支
+                }
+            } else { //其他语句依次执行其子语句
+                Stmt::child_iterator it = node->child_begin(), ie = node->child_end();
+                for(unsigned i = 0; it != ie && i < step; ++it, ++i) {}
+                while(it != ie && !*it) { ++it; mConts.back().step++; }
+                if(it == ie) mConts.pop_back();
+                else pushStmt(*it);
+            }
+        }
+    }
+
+    //循环已编译时在本机代码中执行其余的迭代，之后循环结束或函数返回
+    bool enterNativeLoop(Stmt *loop) {
+        JitTier::LoopEntry native = mJit ? mJit->loop(loop) : NULL;
+        if(!native) return false;
+        long ret = 0;
+        if(native(mSlots.data() + mStack.back().getBase(), mStack.back().getArrays(), &ret)) {
+            mStack.back().setRetValue(ret);
+            mStack.back().setReturned();
+            mConts.resize(mStack.back().getContBase());
+            mValues.resize(mStack.back().getValueBase());
+        } else mConts.pop_back();
+        return true;
+    }
+
+    //为computeLayout遍历AST，求出全部表达式与数组变量用到的大小
+    class LayoutCollector : public RecursiveASTVisitor<LayoutCollector> {
+        ASTContext &mContext;
+        TypeLayout &mLayout;
+    public:
+        LayoutCollector(ASTContext &context, TypeLayout &layout) : mContext(context), mLayout(layout) {}
+        bool VisitArraySubscriptExpr(ArraySubscriptExpr *e) {
+            mLayout.memTypes[e] = memTypeOf(mContext, e->getType());
+            return true;
+        }
+        bool VisitUnaryOperator(UnaryOperator *uop) {
+            if(uop->getOpcode() == UO_Deref) mLayout.memTypes[uop] = memTypeOf(mContext, uop->getType());
+            return true;
+        }
+        bool VisitBinaryOperator(BinaryOperator *bop) {
+            if(bop->isAdditiveOp()) mLayout.scales[bop] = scaleOf(mContext, bop);
+            return true;
+        }
+        bool VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr *tte) {
+            mLayout.sizes[tte] = sizeofexpr(mContext, tte);
+            return true;
+        }
+        bool VisitVarDecl(VarDecl *vd) {
+            if(isa<ConstantArrayType>(vd->getType().getTypePtr())) mLayout.arrayWords[vd] = wordsOf(mContext, vd->getType());
+            return true;
+        }
+    };
+
 public:
-    Environment() : mStack(), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL), mEntry(NULL) {}
+    explicit Environment(InterpreterIO *io) : mStack(), mSlots(), mGlobals(), mConts(), mValues(), mHeap(), mArena(), mLayout(NULL), mOwnLayout(), mIO(io), mProf(NULL), mJit(NULL), mStackBudget((size_t)1 << 30), mOverflow(false), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL), mEntry(NULL) {}
+    //预处理：为每个全局变量、参数和局部变量分配固定槽位
+    void resolve(TranslationUnitDecl *unit) {
+        if(!mLayout) {
+            computeLayout(unit, mOwnLayout);
+            mLayout = &mOwnLayout;
+        }
+        for(TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i) {
+            if(VarDecl *vdecl = dyn_cast<VarDecl>(*i)) {
+                mVarSlots[vdecl] = VarSlot{(unsigned)mGlobals.size(), true, 0};
+                mGlobals.push_back(0);
+            } else if(FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i)) {
+                if(!fdecl->doesThisDeclarationHaveABody()) continue;
+                std::map<VarDecl *, int> locals; //参数占用前面的槽位
+                for(unsigned j = 0; j < fdecl->getNumParams(); j++) locals[fdecl->getParamDecl(j)] = j;
+                LocalCollector(locals).TraverseStmt(fdecl->getBody());
+                FrameLayout layout = FrameLayout{(unsigned)locals.size(), 0};
+                for(auto &local : locals) {
+                    mVarSlots[local.first] = VarSlot{(unsigned)local.second, false, layout.arrayWords};
+                    if(isa<ConstantArrayType>(local.first->getType().getTypePtr()))
+                        layout.arrayWords += mLayout->arrayWords.lookup(local.first);
+                }
+                mFrameLayout[fdecl->getCanonicalDecl()] = layout;
+            }
+        }
+    }
     void init(TranslationUnitDecl *unit) {
-        mHeap = new Heap(); //新建一个堆为mHeap
-        mStack.push_back(StackFrame()); //用于保存全局变量
+        resolve(unit);
+        mStack.emplace_back(); //用于计算全局变量的初值
         for(TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i) {
-            if(VarDecl *vdecl = dyn_cast<VarDecl>(*i)) vardecl(vdecl, &(mStack.back())); //处理全局var声明
+            if(VarDecl *vdecl = dyn_cast<VarDecl>(*i)) vardecl(vdecl, hasScalarInit(vdecl) ? eval(vdecl->getInit()) : 0); //处理全局var声明
             else if(FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i)) { //处理外部方法声明
                 if(fdecl->getName().equals("FREE")) mFree = fdecl;
                 else if(fdecl->getName().equals("MALLOC")) mMalloc = fdecl;
                 else if(fdecl->getName().equals("GET")) mInput = fdecl;
                 else if(fdecl->getName().equals("PRINT")) mOutput = fdecl;
-                else if(fdecl->getName().equals("main")) { //函数名为main的是入口函数
-                    mEntry = fdecl; 
-                    mStack.push_back(StackFrame());
-                }
+                else if(fdecl->getName().equals("main")) mEntry = fdecl; //函数名为main的是入口函数
             }
         }
+        if(mEntry) {
+            FrameLayout layout = mFrameLayout.lookup(mEntry->getCanonicalDecl());
+            FrameArena::Mark mark = mArena.mark();
+            mSlots.resize(layout.slots);
+            mStack.emplace_back(0, mArena.alloc(layout.arrayWords), mark);
+        }
+    }
+    //执行入口函数，超出栈预算时返回false
+    bool run() {
+        if(!mEntry || !mEntry->getBody()) return true;
+        if(mProf) mProf->enter(mEntry);
+        pushStmt(mEntry->getBody());
+        execute(0);
+        if(mProf && !mOverflow) mProf->exit();
+        return !mOverflow;
+    }
+    //在续体栈上求值一个表达式
+    long eval(Expr *e) {
+        size_t base = mConts.size();
+        pushExpr(e);
+        execute(base);
+        return mOverflow ? 0 : pop();
+    }
+    //返回变量在当前栈帧或全局区中的存储位置
+    long &var(Decl *decl) {
+        llvm::DenseMap<Decl *, VarSlot>::iterator it = mVarSlots.find(decl);
+        assert(it != mVarSlots.end());
+        if(it->second.global) return mGlobals[it->second.index];
+        return mSlots[mStack.back().getBase() + it->second.index];
+    }
+    static Expr *strip(Expr *e) {
+        for(;;) {
+            e = e->IgnoreImpCasts(); //忽略隐性类型转化
+            if(ParenExpr *i = dyn_cast<ParenExpr>(e)) e = i->getSubExpr();
+            else if(CStyleCastExpr *i = dyn_cast<CStyleCastExpr>(e)) e = i->getSubExpr();
+            else return e;
+        }
+    }
+    const VarSlot *slotOf(Decl *decl) {
+        llvm::DenseMap<Decl *, VarSlot>::iterator it = mVarSlots.find(decl);
+        return it == mVarSlots.end() ? NULL : &it->second;
+    }
+    FrameLayout layoutOf(FunctionDecl *f) { return mFrameLayout.lookup(f->getCanonicalDecl()); }
+    const TypeLayout &getLayout() { return *mLayout; }
+    //遍历整个翻译单元求出layout，要在开始运行前于单一线程中调用
+    static void computeLayout(TranslationUnitDecl *unit, TypeLayout &layout) { LayoutCollector(unit->getASTContext(), layout).TraverseDecl(unit); }
+    //类型在解释器内存中占用的字节数，void与函数类型按1计（GNU的指针运算规则）
+    static long sizeOf(ASTContext &ctx, QualType type) {
+        if(type->isIncompleteType() || type->isFunctionType() || !type->isConstantSizeType()) return 1;
+        return ctx.getTypeSizeInChars(type).getQuantity();
+    }
+    //数组占用的long个数，各数组的起点按long对齐
+    static unsigned wordsOf(ASTContext &ctx, QualType type) { return (sizeOf(ctx, type) + sizeof(long) - 1) / sizeof(long); }
+    //读写内存时的元素类型：整数按实际大小与符号，指针等其余类型按long
+    static MemType memTypeOf(ASTContext &ctx, QualType type) {
+        if(!type->isIntegerType()) return MemType{sizeof(long), true};
+        return MemType{(unsigned char)sizeOf(ctx, type), type->isSignedIntegerType()};
+    }
+    //指针加减整数时整数的缩放倍数，不是指针加减整数时为0
+    static long scaleOf(ASTContext &ctx, BinaryOperator *bop) {
+        QualType left = bop->getLHS()->getType(), right = bop->getRHS()->getType();
+        if(!left->isPointerType() || right->isPointerType()) return 0;
+        return sizeOf(ctx, left->getPointeeType());
     }
+    static long sizeofexpr(ASTContext &ctx, UnaryExprOrTypeTraitExpr *tte) { return tte->getKind() == UETT_SizeOf ? sizeOf(ctx, tte->getTypeOfArgument()) : -1; }
+    long *getGlobals() { return mGlobals.data(); }
+    Heap &getHeap() { return mHeap; }
+    InterpreterIO &getIO() { return *mIO; }
     FunctionDecl *getEntry() { return mEntry; }
+    FunctionDecl *getInput() { return mInput; }
+    FunctionDecl *getOutput() { return mOutput; }
+    FunctionDecl *getMalloc() { return mMalloc; }
+    FunctionDecl *getFree() { return mFree; }
+    void setProfiler(Profiler *prof) { mProf = prof; }
+    void setJit(JitTier *jit) { mJit = jit; }
+    void setStackBudget(size_t bytes) { mStackBudget = bytes; }
+    //使用事先求好的类型大小，须在init之前调用
+    void setLayout(const TypeLayout *layout) { mLayout = layout; }
     bool isExternalCall(FunctionDecl *f) { return f == mFree || f == mMalloc || f == mInput || f == mOutput; }
     bool isCurFuncReturned() { return mStack.back().isReturned(); }
-    void sizeofexpr(UnaryExprOrTypeTraitExpr *tte) { mStack.back().bindStmt(tte, sizeof(long)); }
-    void decl(DeclStmt *ds) { for(DeclStmt::decl_iterator it = ds->decl_begin(), ie = ds->decl_end(); it != ie; ++it) if(VarDecl *vdecl = dyn_cast<VarDecl>(*it)) vardecl(vdecl, &(mStack.back()));}
-    // 对语句分情况进行操作
-    long expr(Expr *exp) {
-        Expr *e = exp->IgnoreImpCasts(); //忽略隐性类型转化
-        if(BinaryOperator *bop = dyn_cast<BinaryOperator>(e)) { //二元运算符
-            binop(bop); //对bop进行操作
-            return mStack.back().getStmtVal(bop); //返回bop指向的值
-        } else if(IntegerLiteral *i = dyn_cast<IntegerLiteral>(e)) { //整数型常量
-            return (long)i->getValue().getSExtValue();
-        } else if(CharacterLiteral *i = dyn_cast<CharacterLiteral>(e)) { //字符型常量
-            return i->getValue();
-        } else if(DeclRefExpr *i = dyn_cast<DeclRefExpr>(e)) { //引用已有变量
-            declref(i);
-            return mStack.back().getStmtVal(i);
-        } else if(CallExpr *i = dyn_cast<CallExpr>(e)) { //调用语句
-            return mStack.back().getStmtVal(i);
-        } else if(UnaryOperator *i = dyn_cast<UnaryOperator>(e)) { //一元运算符
-            return mStack.back().getStmtVal(i);
-        } else if(ParenExpr *i = dyn_cast<ParenExpr>(e)) { //圆括号表达式
-            return mStack.back().getStmtVal(i);
-        } else if(ArraySubscriptExpr *i = dyn_cast<ArraySubscriptExpr>(e)) { //数组元素
-            return mStack.back().getStmtVal(i);
-        } else if(UnaryExprOrTypeTraitExpr *i = dyn_cast<UnaryExprOrTypeTraitExpr>(e)) {
-            return mStack.back().getStmtVal(i);
-        } else if(CStyleCastExpr *i = dyn_cast<CStyleCastExpr>(e)) {
-            return expr(i->getSubExpr());
-        } else return -1;
+    //整数、字符和指针变量的初值需要求值，数组在vardecl中分配
+    static bool hasScalarInit(VarDecl *vd) {
+        const Type *type = vd->getType().getTypePtr();
+        return vd->hasInit() && (type->isIntegerType() || type->isCharType() || type->isPointerType());
     }
-    void parenexpr(ParenExpr *pe) {
-        Expr *e = pe->getSubExpr(); //得到子树？
-        long value = expr(e); //返回的是当前stack中mExprs中的expr e
-        mStack.back().bindStmt(pe, value);
+    //逐个处理声明，step为2i时从第i个声明开始，为2i+1时第i个声明的初值已在值栈顶
+    void decl(DeclStmt *ds, unsigned step) {
+        unsigned idx = step / 2;
+        DeclStmt::decl_iterator it = ds->decl_begin() + idx, ie = ds->decl_end();
+        if(step % 2) {
+            vardecl(cast<VarDecl>(*it), pop());
+            ++it, ++idx;
+        }
+        for(; it != ie; ++it, ++idx) {
+            VarDecl *vdecl = dyn_cast<VarDecl>(*it);
+            if(!vdecl) continue;
+            if(hasScalarInit(vdecl)) {
+                mConts.back().step = 2 * idx + 1;
+                pushExpr(vdecl->getInit());
+                return;
+            }
+            vardecl(vdecl, 0);
+        }
+        mConts.pop_back();
     }
-    void assignment(Expr *left, Expr *right) {
-        long leftval, rightval = expr(right);
+    //赋值时先求左侧的下标或地址，再求右侧的值
+    void assignment(BinaryOperator *bop, unsigned step) {
+        Expr *left = bop->getLHS(), *right = bop->getRHS();
         if(DeclRefExpr *i = dyn_cast<DeclRefExpr>(left)) { //变量赋值
-            mStack.back().bindStmt(left, rightval);
-            Decl *decl = i->getFoundDecl(); //得到left表示的变量的地址
-            if(mStack.back().findDecl(decl)) mStack.back().bindDecl(decl, rightval); //修改局部变量
-            else mStack.front().bindDecl(decl, rightval); //修改全局变量
+            if(step == 0) return pushExpr(right);
+            var(i->getDecl()) = mValues.back(); //修改局部变量或全局变量
         } else if(ArraySubscriptExpr *i = dyn_cast<ArraySubscriptExpr>(left)) { //数组赋值
-            long leftval = expr(i->getIdx());
+            if(step == 0) return pushExpr(i->getIdx());
+            if(step == 1) return pushExpr(right);
+            long rightval = pop(), leftval = mValues.back();
             DeclRefExpr *declref = dyn_cast<DeclRefExpr>(i->getLHS()->IgnoreImpCasts());
-            Decl *decl = declref->getFoundDecl();
-            long *arr = (long *)(mStack.back().findDecl(decl) ? mStack.back().getDeclVal(decl):mStack.front().getDeclVal(decl));
-            arr[leftval] = rightval;
+            MemType type = mLayout->memTypes.lookup(i);
+            storeMem((char *)var(declref->getDecl()) + leftval * type.size, type, rightval);
+            mValues.back() = rightval;
         } else if(UnaryOperator *i = dyn_cast<UnaryOperator>(left)) { //一元运算符
-            leftval = expr(i->getSubExpr());
-            mHeap->Update((long *)leftval, rightval);
-        }
+            if(step == 0) return pushExpr(i->getSubExpr());
+            if(step == 1) return pushExpr(right);
+            long rightval = pop(), leftval = mValues.back();
+            mHeap.Update((char *)leftval, mLayout->memTypes.lookup(i), rightval);
+            mValues.back() = rightval;
+        } else if(step == 0) return pushExpr(right);
+        mConts.pop_back();
     }
     // 二元运算符分情况讨论 ok
-    void binop(BinaryOperator *bop) {
+    void binop(BinaryOperator *bop, unsigned step) {
+        if(bop->isAssignmentOp()) return assignment(bop, step);
         Expr *left = bop->getLHS(); //左语句
         Expr *right = bop->getRHS(); //右语句
-        long leftval, rightval = expr(right);
-        if(bop->isAssignmentOp()) {
-            assignment(left, right);
-        } else {
-            leftval = expr(left);
-            if(bop->isComparisonOp()) {
-                switch (bop->getOpcode()) {
-                    case BO_GT: mStack.back().bindStmt(bop, (leftval > rightval)); break;
-                    case BO_LT: mStack.back().bindStmt(bop, (leftval < rightval)); break;
-                    case BO_EQ: mStack.back().bindStmt(bop, (leftval == rightval)); break;
-                    case BO_GE: mStack.back().bindStmt(bop, (leftval >= rightval)); break;
-                    case BO_LE: mStack.back().bindStmt(bop, (leftval <= rightval)); break;
-                    case BO_NE: mStack.back().bindStmt(bop, (leftval != rightval)); break;
-                }
-            } else if(bop->isAdditiveOp()) {  // 加号和减号操作符
-                rightval *= (left->getType().getTypePtr()->isPointerType() && !right->getType().getTypePtr()->isPointerType()) ? sizeof(long):1;
-                if(bop->getOpcode() == BO_Add) mStack.back().bindStmt(bop, leftval+rightval);
-                else mStack.back().bindStmt(bop, leftval-rightval);
-            } else if(bop->isMultiplicativeOp()) {  // 乘法和除法操作符
-                if(bop->getOpcode() == BO_Mul) mStack.back().bindStmt(bop, leftval*rightval);
-                else mStack.back().bindStmt(bop, leftval/rightval);
+        if(step == 0) return pushExpr(left);
+        if(step == 1) return pushExpr(right);
+        mConts.pop_back();
+        long rightval = pop(), leftval = mValues.back(), &result = mValues.back();
+        result = -1;
+        if(bop->isComparisonOp()) {
+            switch (bop->getOpcode()) {
+                case BO_GT: result = leftval > rightval; break;
+                case BO_LT: result = leftval < rightval; break;
+                case BO_EQ: result = leftval == rightval; break;
+                case BO_GE: result = leftval >= rightval; break;
+                case BO_LE: result = leftval <= rightval; break;
+                case BO_NE: result = leftval != rightval; break;
+                default: break;
             }
+        } else if(bop->isAdditiveOp()) {  // 加号和减号操作符
+            if(long scale = mLayout->scales.lookup(bop)) rightval *= scale; //指针加减整数按所指类型的大小缩放
+            if(bop->getOpcode() == BO_Add) result = leftval+rightval;
+            else result = leftval-rightval;
+        } else if(bop->isMultiplicativeOp()) {  // 乘法和除法操作符
+            if(bop->getOpcode() == BO_Mul) result = leftval*rightval;
+            else if(bop->getOpcode() == BO_Rem) result = leftval%rightval;
+            else result = leftval/rightval;
         }
     }
     // 一元运算符分情况讨论
-    void unaryop(UnaryOperator *uop) {
-        Expr *e = uop->getSubExpr();
-        long value = expr(e);
+    long unaryop(UnaryOperator *uop, long value) {
         if(uop->getOpcode() == UO_Plus) {
-            mStack.back().bindStmt(uop, value);
+            return value;
         } else if(uop->getOpcode() == UO_Minus) {
-            mStack.back().bindStmt(uop, -value);
+            return -value;
         } else if(uop->getOpcode() == UO_Deref) {
-            mStack.back().bindStmt(uop, mHeap->Get((long *)value));
+            return mHeap.Get((char *)value, mLayout->memTypes.lookup(uop));
         }
+        return -1;
     }
-    void callFunction(CallExpr *callexpr) {
-        StackFrame current = StackFrame();
-        for(int i = 0; i < callexpr->getDirectCallee()->getNumParams(); i++) { //？不知道行不行
-            long val = expr(callexpr->getArg(i));
-            VarDecl *addr = dyn_cast<VarDecl>(callexpr->getDirectCallee()->getParamDecl(i));
-            vardecl(addr, &current);
-            current.bindDecl(addr, val);
-        }
-        mStack.push_back(current);
-    }
-    void call(CallExpr *callexpr) {
-        mStack.back().setPC(callexpr);
-        long val = 0;
+    //调用：先依次求出实参，内建函数直接执行，用户函数原地压入新栈帧后执行函数体
+    void call(CallExpr *callexpr, unsigned step) {
         FunctionDecl *callee = callexpr->getDirectCallee();
-        if(!isExternalCall(callee)) callFunction(callexpr);
-        else{
+        unsigned nargs = callexpr->getNumArgs();
+        if(isExternalCall(callee)) {
+            if(callee != mInput && step == 0) return pushExpr(callexpr->getArg(0));
+            mStack.back().setPC(callexpr);
+            mConts.pop_back();
             if(callee == mInput) { //输入
-                llvm::errs() << "Please Input an Integer Value : ";
-                scanf("%ld", &val);
-                mStack.back().bindStmt(callexpr, val);
+                mValues.push_back(mIO->get());
             } else if(callee == mOutput) { //输出
-                val = expr(callexpr->getArg(0));
-                llvm::errs() << val;
+                mIO->print(mValues.back());
+                mValues.back() = 0;
             } else if(callee == mMalloc) { //内存申请
-                val = expr(callexpr->getArg(0));
-                mStack.back().bindStmt(callexpr, (long)mHeap->Malloc(val));
+                mValues.back() = (long)mHeap.Malloc(mValues.back());
             } else if(callee == mFree) { //内存释放
-                val = expr(callexpr->getArg(0));
-                mHeap->Free((long *)val);
+                mHeap.Free((long *)mValues.back());
+                mValues.back() = 0;
             }
+            return;
         }
+        if(step < nargs) return pushExpr(callexpr->getArg(step));
+        if(step == nargs && mJit) { //已编译的函数直接调用本机代码
+            if(JitTier::FunctionEntry native = mJit->function(callee)) {
+                size_t valueBase = mValues.size() - nargs;
+                mValues.resize(valueBase + std::max<size_t>(nargs, callee->getNumParams()));
+                long ret = native(mValues.data() + valueBase);
+                mValues.resize(valueBase);
+                mValues.push_back(ret);
+                mConts.pop_back();
+                return;
+            }
+        }
+        if(step == nargs) { //实参依次占用新栈帧的前几个槽位
+            mStack.back().setPC(callexpr);
+            FrameLayout layout = mFrameLayout.lookup(callee->getCanonicalDecl());
+            size_t base = mSlots.size(), valueBase = mValues.size() - nargs;
+            mSlots.resize(base + std::max<size_t>(layout.slots, nargs));
+            std::copy(mValues.begin() + valueBase, mValues.end(), mSlots.begin() + base);
+            mValues.resize(valueBase);
+            FrameArena::Mark mark = mArena.mark();
+            mStack.emplace_back(base, mArena.alloc(layout.arrayWords), mark, mConts.size(), valueBase);
+            if(stackBytes() > mStackBudget) { //停止执行，不再回到任何续体
+                llvm::errs() << "error: call to '" << callee->getName() << "' exceeds the interpreter stack budget of " << mStackBudget << " bytes\n";
+                mOverflow = true;
+                mConts.clear();
+                return;
+            }
+            if(mProf) mProf->enter(callee);
+            if(callee->hasBody()) pushStmt(callee->getBody());
+            return;
+        }
+        if(mProf) mProf->exit();
+        long ret = mStack.back().getRetValue();
+        mSlots.resize(mStack.back().getBase()); //释放被调函数的槽位
+        mArena.release(mStack.back().getArenaMark()); //整体释放被调函数的局部数组
+        mStack.pop_back();
+        mConts.pop_back();
+        mValues.push_back(ret);
     }
-    //返回语句
-    void ret(CallExpr *callexpr) {
-        FunctionDecl *callee = callexpr->getDirectCallee(); //getDirectCallee？
-        if(!callee->isNoReturn()){
-            long ret = mStack.back().getRetValue();
-            mStack.pop_back();
-            mStack.back().bindStmt(callexpr, ret); //将callexpr的值赋为rval
-        } else mStack.pop_back();
-    }
+    //记录返回值后丢弃函数体中尚未执行的续体，回到调用处
     void retstmt(ReturnStmt *rstmt) {
-        if(rstmt->getRetValue()) mStack.back().setRetValue(expr(rstmt->getRetValue())); //将rval存为RetValue
+        if(rstmt->getRetValue()) mStack.back().setRetValue(pop()); //将rval存为RetValue
         mStack.back().setReturned(); //将returned设为true、
+        mConts.resize(mStack.back().getContBase());
+        mValues.resize(mStack.back().getValueBase());
     }
-    void vardecl(VarDecl *vd, StackFrame *sf) {
+    void vardecl(VarDecl *vd, long value) {
         if(vd->getType().getTypePtr()->isIntegerType() || vd->getType().getTypePtr()->isCharType()) { //vdecl类型为整数型或字符型
-            long value = vd->hasInit() ? expr(vd->getInit()) : 0;
-            sf->bindDecl(vd, value); //将value存到vdecl中
-        } else if(vd->getType().getTypePtr()->isArrayType()) { //vdecl为数组类型
-            const ConstantArrayType *arr_type = dyn_cast<ConstantArrayType>(vd->getType().getTypePtr());
-            int arr_size = arr_type->getSize().getSExtValue();
-            assert(arr_size >= 0);
-            if(arr_type->getElementType().getTypePtr()->isIntegerType()) sf->bindDecl(vd, (long)(new long[arr_size]));
-            else if(arr_type->getElementType().getTypePtr()->isPointerType()) sf->bindDecl(vd, (long)(new long *[arr_size]));
+            var(vd) = value; //将value存到vdecl中
+        } else if(vd->getType().getTypePtr()->isArrayType()) { //vdecl为数组类型，局部数组已在压栈时分配
+            assert(isa<ConstantArrayType>(vd->getType().getTypePtr()));
+            const VarSlot &slot = mVarSlots.find(vd)->second;
+            if(slot.global) var(vd) = (long)mArena.alloc(mLayout->arrayWords.lookup(vd));
+            else var(vd) = (long)(mStack.back().getArrays() + slot.array);
         } else if(vd->getType().getTypePtr()->isPointerType()) {
-            long value = vd->hasInit() ? expr(vd->getInit()) : 0;
-            sf->bindDecl(vd, value);
-        } else sf->bindDecl(vd, 0);
+            var(vd) = value;
+        } else var(vd) = 0;
     }
-    void declref(DeclRefExpr *declref) {
+    long declref(DeclRefExpr *declref) {
         mStack.back().setPC(declref);
-        if(declref->getType()->isIntegerType() || declref->getType()->isPointerType()) { //declref为整数型或指针类型
-            Decl *decl = declref->getFoundDecl();
-            long val = mStack.back().findDecl(decl) ? mStack.back().getDeclVal(decl) : mStack.front().getDeclVal(decl);
-            mStack.back().bindStmt(declref, val);
-        }
+        return var(declref->getDecl());
     }
-    void arrayref(ArraySubscriptExpr *aexpr) {
-        long index = expr(aexpr->getIdx());
+    long arrayref(ArraySubscriptExpr *aexpr, long index) {
         DeclRefExpr *declref = dyn_cast<DeclRefExpr>(aexpr->getLHS()->IgnoreImpCasts()); //判断declref是否为声明引用
         assert(declref);
-        Decl *decl = declref->getFoundDecl();
-        long *arr = (long *)(mStack.back().findDecl(decl) ? mStack.back().getDeclVal(decl) : mStack.front().getDeclVal(decl));
-        mStack.back().bindStmt(aexpr, arr[index]);
-    }
-    //类型转化
-    void cast(CastExpr *castexpr) {
-        mStack.back().setPC(castexpr);
-        if(castexpr->getType()->isIntegerType()) {
-            Expr *expr = castexpr->getSubExpr();
-            long val = mStack.back().getStmtVal(expr); //得到expr的值
-            mStack.back().bindStmt(castexpr, val); //然后赋给castexpr
-        } else if(castexpr->getType()->isPointerType()) {}
-    }
-    //常量声明
-    void integerLiteral(IntegerLiteral *ll) {
-        long value = (long)ll->getValue().getLimitedValue(); //得到文字literal中的value
-        mStack.back().bindStmt(ll, value); //将语句literal的值赋为value
+        MemType type = mLayout->memTypes.lookup(aexpr);
+        return loadMem((char *)var(declref->getDecl()) + index * type.size, type);
     }
-    void characterLiteral(CharacterLiteral *cl) {
-        long value = (long)cl->getValue();
-        mStack.back().bindStmt(cl, value);
-    }
-};
\ No newline at end of file
+};
+#endif /* !_ENVIRONMENT_H_ */
@@ -0,0 +1,161 @@
+//==--- Heap.h - 解释器堆 -----------------------------------------------===//
+//
+// MALLOC/FREE的实现。小块按8字节分级，从大块内存中切分，释放后挂回
+// 所在级别的空闲表重复使用；超过kMaxSmall的块单独申请。
+// 已分配的块记录在以起始地址排序的区间索引中，解引用时用它检查被访问的
+// 字节是否都落在某个块内，查找为O(log n)，并缓存最近一次命中的块。
+// 内存按Clang类型的实际大小读写，MemType给出一个元素的字节数与符号。
+// FrameArena为局部数组提供按栈帧整体分配、整体释放的内存。
+//===----------------------------------------------------------------------===//
+#ifndef _HEAP_H_
+#define _HEAP_H_
+#include <stddef.h>
+#include <string.h>
+
+#include <map>
+#include <utility>
+#include <vector>
+
+//内存中一个元素的字节数（1、2、4或8）与符号
+struct MemType {
+    unsigned char size;
+    bool isSigned;
+};
+
+//按类型T读写一个元素，读出的值扩展为long，写入时截断
+template <class T>
+static long loadAs(const char *addr) {
+    T val;
+    memcpy(&val, addr, sizeof(T));
+    return (long)val;
+}
+template <class T>
+static void storeAs(char *addr, long val) {
+    T v = (T)val;
+    memcpy(addr, &v, sizeof(T));
+}
+static long loadMem(const char *addr, MemType type) {
+    switch(type.size) {
+        case 1: return type.isSigned ? loadAs<signed char>(addr) : loadAs<unsigned char>(addr);
+        case 2: return type.isSigned ? loadAs<short>(addr) : loadAs<unsigned short>(addr);
+        case 4: return type.isSigned ? loadAs<int>(addr) : loadAs<unsigned int>(addr);
+        default: return loadAs<long>(addr);
+    }
+}
+static void storeMem(char *addr, MemType type, long val) {
+    switch(type.size) {
+        case 1: storeAs<char>(addr, val); break;
+        case 2: storeAs<short>(addr, val); break;
+        case 4: storeAs<int>(addr, val); break;
+        default: storeAs<long>(addr, val); break;
+    }
+}
+
+class Heap {
+    enum : size_t {
+        kAlign = sizeof(long),
+        kMaxSmall = 1024,
+        kChunkSize = 1 << 20
+    };
+    std::map<char *, size_t> block; //已分配的块，左为起始地址，右为对齐后的大小
+    std::vector<char *> mFree[kMaxSmall / kAlign + 1]; //各级空闲块
+    std::vector<char *> mChunks; //切分小块用的大块内存
+    char *mCur, *mEnd; //当前大块中未切分的部分
+    char *mLastBegin, *mLastEnd; //最近一次命中的块
+
+    static size_t align(size_t size) { return size ? (size + kAlign - 1) / kAlign * kAlign : kAlign; }
+    char *carve(size_t size) {
+        if((size_t)(mEnd - mCur) < size) {
+            mCur = new char[kChunkSize];
+            mEnd = mCur + kChunkSize;
+            mChunks.push_back(mCur);
+        }
+        char *addr = mCur;
+        mCur += size;
+        return addr;
+    }
+    //[addr, addr + size)是否落在某个已分配的块内
+    bool contains(char *addr, size_t size) {
+        if(addr >= mLastBegin && addr + size <= mLastEnd) return true;
+        std::map<char *, size_t>::iterator it = block.upper_bound(addr);
+        if(it == block.begin()) return false;
+        --it;
+        if(addr + size > it->first + it->second) return false;
+        mLastBegin = it->first;
+        mLastEnd = it->first + it->second;
+        return true;
+    }
+
+public:
+    Heap() : block(), mChunks(), mCur(NULL), mEnd(NULL), mLastBegin(NULL), mLastEnd(NULL) {}
+    ~Heap() {
+        for(auto &i : block) if(i.second > kMaxSmall) delete[] i.first;
+        for(char *chunk : mChunks) delete[] chunk;
+    }
+    Heap(const Heap &) = delete;
+    Heap &operator=(const Heap &) = delete;
+
+    long *Malloc(int size) {
+        size_t bytes = align(size > 0 ? size : 0);
+        char *addr;
+        if(bytes <= kMaxSmall) {
+            std::vector<char *> &freelist = mFree[bytes / kAlign];
+            if(!freelist.empty()) {
+                addr = freelist.back();
+                freelist.pop_back();
+            } else addr = carve(bytes);
+        } else addr = new char[bytes];
+        block[addr] = bytes;
+        return (long *)addr;
+    }
+    void Free(long *ptr) {
+        std::map<char *, size_t>::iterator it = block.find((char *)ptr);
+        if(it == block.end()) return;
+        if(it->second <= kMaxSmall) mFree[it->second / kAlign].push_back(it->first);
+        else delete[] it->first;
+        if(it->first == mLastBegin) mLastBegin = mLastEnd = NULL;
+        block.erase(it);
+    }
+    void Update(char *addr, MemType type, long val) { if(contains(addr, type.size)) storeMem(addr, type, val); }
+    long Get(char *addr, MemType type) { return contains(addr, type.size) ? loadMem(addr, type) : -1; }
+    //元素类型在编译期已知时使用
+    template <class T>
+    void UpdateAs(char *addr, long val) { if(contains(addr, sizeof(T))) storeAs<T>(addr, val); }
+    template <class T>
+    long GetAs(char *addr) { return contains(addr, sizeof(T)) ? loadAs<T>(addr) : -1; }
+};
+
+//栈帧数组区：调用函数时一次性切出其全部局部数组，返回时退回到调用前的位置
+//大块内存不归还，之后的调用直接复用，稳定状态下不再申请内存
+class FrameArena {
+    enum : size_t { kChunkSize = 1 << 20 };
+    std::vector<std::pair<char *, size_t> > mChunks; //大块内存及其大小
+    size_t mChunk, mOffset; //当前所在的大块及其中已用的字节数
+    size_t mBytes; //全部大块的总大小
+
+public:
+    typedef std::pair<size_t, size_t> Mark;
+    FrameArena() : mChunks(), mChunk(0), mOffset(0), mBytes(0) {}
+    ~FrameArena() { for(auto &chunk : mChunks) delete[] chunk.first; }
+    FrameArena(const FrameArena &) = delete;
+    FrameArena &operator=(const FrameArena &) = delete;
+
+    Mark mark() const { return Mark(mChunk, mOffset); }
+    void release(Mark m) { mChunk = m.first; mOffset = m.second; }
+    size_t bytes() const { return mBytes; }
+    long *alloc(size_t words) {
+        size_t bytes = words * sizeof(long);
+        if(!bytes) return NULL;
+        while(mChunk < mChunks.size() && mChunks[mChunk].second - mOffset < bytes) { mChunk++; mOffset = 0; }
+        if(mChunk == mChunks.size()) {
+            size_t size = bytes > kChunkSize ? bytes : kChunkSize;
+            mChunks.push_back(std::make_pair(new char[size], size));
+            mBytes += size;
+            mOffset = 0;
+        }
+        char *addr = mChunks[mChunk].first + mOffset;
+        mOffset += bytes;
+        return (long *)addr;
+    }
+};
+#endif /* !_HEAP_H_ */
@@ -0,0 +1,97 @@
+//==--- IO.h - GET与PRINT的输入输出 -------------------------------------===//
+//
+// 交互模式下GET先在stderr上提示再用scanf读取，PRINT直接写到stderr。
+// 批处理模式下GET不再提示，从文件或stdin成块读入后自行解析；
+// PRINT写到带缓冲的stdout，运行结束时统一刷新。
+// 内存模式与批处理模式相同，但输入输出都是内存中的字符串，供并行运行使用。
+//===----------------------------------------------------------------------===//
+#ifndef _IO_H_
+#define _IO_H_
+#include <ctype.h>
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+class InterpreterIO {
+    enum : size_t { kBufSize = 1 << 16 };
+    bool mBatch;
+    FILE *mIn; //内存模式下为NULL
+    char *mBuf; //批处理模式的输入缓冲区
+    const char *mData; //尚未解析的输入
+    size_t mPos, mLen;
+    llvm::raw_ostream *mOut;
+    std::unique_ptr<llvm::raw_string_ostream> mString; //内存模式的输出
+
+    int peek() {
+        if(mPos == mLen) {
+            if(!mIn) return EOF;
+            mLen = fread(mBuf, 1, kBufSize, mIn);
+            mData = mBuf;
+            mPos = 0;
+            if(mLen == 0) return EOF;
+        }
+        return (unsigned char)mData[mPos];
+    }
+
+public:
+    InterpreterIO() : mBatch(false), mIn(stdin), mBuf(NULL), mData(NULL), mPos(0), mLen(0), mOut(&llvm::errs()), mString() {}
+    ~InterpreterIO() {
+        flush();
+        if(mIn && mIn != stdin) fclose(mIn);
+        delete[] mBuf;
+    }
+    InterpreterIO(const InterpreterIO &) = delete;
+    InterpreterIO &operator=(const InterpreterIO &) = delete;
+
+    //切换到批处理模式，path为"-"时从stdin读取，文件打不开时返回false
+    bool setBatch(const std::string &path) {
+        if(path != "-" && !(mIn = fopen(path.c_str(), "r"))) {
+            mIn = stdin;
+            return false;
+        }
+        mBatch = true;
+        mBuf = new char[kBufSize];
+        mOut = &llvm::outs();
+        mOut->SetBufferSize(kBufSize);
+        return true;
+    }
+    //切换到内存模式，input需在运行期间保持有效，输出在flush()后写入output
+    void setMemory(llvm::StringRef input, std::string &output) {
+        mBatch = true;
+        mIn = NULL;
+        mData = input.data();
+        mPos = 0;
+        mLen = input.size();
+        mString.reset(new llvm::raw_string_ostream(output));
+        mOut = mString.get();
+    }
+    //与scanf("%ld")一致：跳过空白后读入带符号整数，读不到时返回0
+    long get() {
+        long val = 0;
+        if(!mBatch) {
+            llvm::errs() << "Please Input an Integer Value : ";
+            scanf("%ld", &val);
+            return val;
+        }
+        int c;
+        while((c = peek()) != EOF && isspace(c)) mPos++;
+        bool neg = c == '-';
+        if(c == '-' || c == '+') {
+            mPos++;
+            c = peek();
+        }
+        while(c != EOF && isdigit(c)) {
+            val = val * 10 + (c - '0');
+            mPos++;
+            c = peek();
+        }
+        return neg ? -val : val;
+    }
+    void print(long val) { *mOut << val; }
+    void flush() { mOut->flush(); }
+};
+#endif /* !_IO_H_ */
@@ -0,0 +1,511 @@
+//==--- Jit.h - 热点函数与循环的即时编译 --------------------------------===//
+//
+// 分层执行：函数先由Environment解释执行，调用次数或循环回边次数超过阈值后，
+// 把该函数（或正在执行的循环）连同它调用到的函数降低为LLVM IR，经ORC LLJIT
+// 编译为本机代码，之后的调用或迭代直接进入本机代码。
+// 本机代码通过回调使用解释器的GET/PRINT/MALLOC/FREE与堆检查，全局变量直接
+// 读写Environment的全局区，求值顺序与各结构的结果都与Environment一致。
+// 含有不支持的结构时放弃编译，继续解释执行。调用环上的函数（递归）以及调用到它们的
+// 函数与循环也不编译，使调用深度始终由解释器按-stack-budget检查。
+//===----------------------------------------------------------------------===//
+#ifndef _JIT_H_
+#define _JIT_H_
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Utils.h"
+
+#include "Environment.h"
+
+//本机代码调用的解释器内建函数，第一个参数为所属的Environment
+static long jitGet(Environment *env) { return env->getIO().get(); }
+static void jitPrint(Environment *env, long val) { env->getIO().print(val); }
+static long jitMalloc(Environment *env, long size) { return (long)env->getHeap().Malloc(size); }
+static void jitFree(Environment *env, long addr) { env->getHeap().Free((long *)addr); }
+static long jitLoad(Environment *env, long addr, long size, long isSigned) { return env->getHeap().Get((char *)addr, MemType{(unsigned char)size, isSigned != 0}); }
+static void jitStore(Environment *env, long addr, long val, long size) { env->getHeap().Update((char *)addr, MemType{(unsigned char)size, true}, val); }
+
+class Jit : public JitTier {
+    //收集循环中用到的局部变量，进入循环时从栈帧槽位读入，离开时写回
+    class LoopLocals : public RecursiveASTVisitor<LoopLocals> {
+        Environment &mEnv;
+        std::vector<VarDecl *> &mVars;
+        llvm::DenseSet<VarDecl *> mSeen;
+        void add(VarDecl *vd) {
+            const VarSlot *slot = mEnv.slotOf(vd);
+            if(slot && !slot->global && mSeen.insert(vd).second) mVars.push_back(vd);
+        }
+    public:
+        LoopLocals(Environment &env, std::vector<VarDecl *> &vars) : mEnv(env), mVars(vars), mSeen() {}
+        bool VisitDeclRefExpr(DeclRefExpr *ref) {
+            if(VarDecl *vd = dyn_cast<VarDecl>(ref->getDecl())) add(vd);
+            return true;
+        }
+        bool VisitVarDecl(VarDecl *vd) {
+            add(vd);
+            return true;
+        }
+    };
+
+    //收集函数体中直接调用的、有函数体的函数
+    class Callees : public RecursiveASTVisitor<Callees> {
+        std::vector<FunctionDecl *> &mDefs;
+    public:
+        explicit Callees(std::vector<FunctionDecl *> &defs) : mDefs(defs) {}
+        bool VisitCallExpr(CallExpr *call) {
+            FunctionDecl *callee = call->getDirectCallee();
+            FunctionDecl *def = callee ? callee->getDefinition() : NULL;
+            if(def) mDefs.push_back(def);
+            return true;
+        }
+    };
+
+    //把一个函数或循环及其调用到的函数生成到同一个模块中
+    class IRGen {
+        Jit &mJit;
+        Environment &mEnv;
+        llvm::LLVMContext &mCtx;
+        llvm::Module &mModule;
+        llvm::IRBuilder<> mBuilder;
+        llvm::Type *mI64;
+        llvm::PointerType *mP64;
+        llvm::DenseMap<FunctionDecl *, llvm::Function *> mFuncs; //本模块中定义的函数
+        std::vector<std::pair<FunctionDecl *, llvm::Function *> > mPending;
+        llvm::DenseMap<VarDecl *, llvm::Value *> mLocals; //局部变量 -> alloca
+        llvm::Value *mArrays; //当前函数的局部数组区
+        llvm::Value *mRetPtr; //生成循环时return的返回值写到这里，生成函数时为NULL
+        std::vector<VarDecl *> mLoopVars; //生成循环时需要写回栈帧的局部变量
+        llvm::Value *mSlots;
+        bool mOk;
+
+        llvm::Value *konst(long val) { return llvm::ConstantInt::get(mI64, (uint64_t)val, true); }
+        llvm::Value *pointer(const void *addr, llvm::Type *type) {
+            return llvm::ConstantExpr::getIntToPtr(llvm::ConstantInt::get(mI64, (uint64_t)(uintptr_t)addr), type);
+        }
+        llvm::Value *fail() {
+            mOk = false;
+            return konst(0);
+        }
+        //调用地址固定的回调，首个参数为mEnv
+        llvm::Value *callback(const void *fn, bool returns, llvm::ArrayRef<llvm::Value *> args) {
+            std::vector<llvm::Type *> params(1, llvm::Type::getInt8PtrTy(mCtx));
+            std::vector<llvm::Value *> values(1, pointer(&mEnv, llvm::Type::getInt8PtrTy(mCtx)));
+            for(llvm::Value *arg : args) {
+                params.push_back(mI64);
+                values.push_back(arg);
+            }
+            llvm::FunctionType *type = llvm::FunctionType::get(returns ? mI64 : llvm::Type::getVoidTy(mCtx), params, false);
+            llvm::Value *ret = mBuilder.CreateCall(type, pointer(fn, type->getPointerTo()), values);
+            return returns ? ret : konst(0);
+        }
+        //当前基本块已结束（例如return之后）时另起一个不可达的块继续生成
+        void reachable() {
+            if(mBuilder.GetInsertBlock()->getTerminator())
+                mBuilder.SetInsertPoint(llvm::BasicBlock::Create(mCtx, "dead", mBuilder.GetInsertBlock()->getParent()));
+        }
+        void branch(llvm::BasicBlock *to) {
+            if(!mBuilder.GetInsertBlock()->getTerminator()) mBuilder.CreateBr(to);
+        }
+        llvm::BasicBlock *block(const char *name) { return llvm::BasicBlock::Create(mCtx, name, mBuilder.GetInsertBlock()->getParent()); }
+        llvm::Value *truth(llvm::Value *val) { return mBuilder.CreateICmpNE(val, konst(0)); }
+
+        llvm::Value *address(VarDecl *vd) {
+            llvm::DenseMap<VarDecl *, llvm::Value *>::iterator it = mLocals.find(vd);
+            if(it != mLocals.end()) return it->second;
+            const VarSlot *slot = mEnv.slotOf(vd);
+            if(!slot || !slot->global) {
+                fail();
+                return pointer(NULL, mP64);
+            }
+            return pointer(mEnv.getGlobals() + slot->index, mP64);
+        }
+        llvm::Value *load(VarDecl *vd) { return mBuilder.CreateLoad(mI64, address(vd)); }
+        //数组元素按实际大小读写，读出的值按符号扩展为i64
+        llvm::Value *element(llvm::Value *base, llvm::Value *index, MemType type) {
+            llvm::Type *elem = llvm::Type::getIntNTy(mCtx, type.size * 8);
+            return mBuilder.CreateGEP(elem, mBuilder.CreateIntToPtr(base, elem->getPointerTo()), index);
+        }
+        llvm::Value *loadElement(llvm::Value *base, llvm::Value *index, MemType type) {
+            llvm::Value *val = mBuilder.CreateLoad(llvm::Type::getIntNTy(mCtx, type.size * 8), element(base, index, type));
+            return type.isSigned ? mBuilder.CreateSExt(val, mI64) : mBuilder.CreateZExt(val, mI64);
+        }
+        void storeElement(llvm::Value *base, llvm::Value *index, MemType type, llvm::Value *val) {
+            mBuilder.CreateStore(mBuilder.CreateTrunc(val, llvm::Type::getIntNTy(mCtx, type.size * 8)), element(base, index, type));
+        }
+        MemType memTypeOf(Expr *e) { return mEnv.getLayout().memTypes.lookup(e); }
+        VarDecl *varOf(Expr *e) {
+            DeclRefExpr *ref = dyn_cast<DeclRefExpr>(e);
+            VarDecl *vd = ref ? dyn_cast<VarDecl>(ref->getDecl()) : NULL;
+            if(!vd) fail();
+            return vd;
+        }
+        //被调函数：已编译过的直接调用其本机地址，否则在本模块中一并生成
+        llvm::FunctionCallee function(FunctionDecl *def) {
+            FunctionDecl *canon = def->getCanonicalDecl();
+            std::vector<llvm::Type *> params(def->getNumParams(), mI64);
+            llvm::FunctionType *type = llvm::FunctionType::get(mI64, params, false);
+            llvm::DenseMap<FunctionDecl *, uint64_t>::iterator native = mJit.mNative.find(canon);
+            if(native != mJit.mNative.end()) return llvm::FunctionCallee(type, pointer((const void *)(uintptr_t)native->second, type->getPointerTo()));
+            llvm::Function *&fn = mFuncs[canon];
+            if(!fn) {
+                fn = llvm::Function::Create(type, llvm::Function::ExternalLinkage, mJit.name("fn"), &mModule);
+                mPending.push_back(std::make_pair(def, fn));
+            }
+            return llvm::FunctionCallee(fn);
+        }
+
+        llvm::Value *assignment(BinaryOperator *bop) {
+            Expr *left = bop->getLHS(), *right = bop->getRHS();
+            if(DeclRefExpr *i = dyn_cast<DeclRefExpr>(left)) {
+                VarDecl *vd = varOf(i);
+                llvm::Value *val = expr(right);
+                if(vd) mBuilder.CreateStore(val, address(vd));
+                return val;
+            } else if(ArraySubscriptExpr *i = dyn_cast<ArraySubscriptExpr>(left)) {
+                llvm::Value *index = expr(i->getIdx()), *val = expr(right);
+                VarDecl *base = varOf(i->getLHS()->IgnoreImpCasts());
+                if(base) storeElement(load(base), index, memTypeOf(i), val);
+                return val;
+            } else if(UnaryOperator *i = dyn_cast<UnaryOperator>(left)) {
+                llvm::Value *addr = expr(i->getSubExpr()), *val = expr(right);
+                callback((const void *)&jitStore, false, {addr, val, konst(memTypeOf(i).size)});
+                return val;
+            }
+            return expr(right);
+        }
+        llvm::Value *binop(BinaryOperator *bop) {
+            if(bop->isAssignmentOp()) return assignment(bop);
+            Expr *left = bop->getLHS(), *right = bop->getRHS();
+            llvm::Value *l = expr(left), *r = expr(right);
+            switch(bop->getOpcode()) {
+                case BO_GT: return mBuilder.CreateZExt(mBuilder.CreateICmpSGT(l, r), mI64);
+                case BO_LT: return mBuilder.CreateZExt(mBuilder.CreateICmpSLT(l, r), mI64);
+                case BO_EQ: return mBuilder.CreateZExt(mBuilder.CreateICmpEQ(l, r), mI64);
+                case BO_GE: return mBuilder.CreateZExt(mBuilder.CreateICmpSGE(l, r), mI64);
+                case BO_LE: return mBuilder.CreateZExt(mBuilder.CreateICmpSLE(l, r), mI64);
+                case BO_NE: return mBuilder.CreateZExt(mBuilder.CreateICmpNE(l, r), mI64);
+                case BO_Add: case BO_Sub:
+                    if(long scale = mEnv.getLayout().scales.lookup(bop)) r = mBuilder.CreateMul(r, konst(scale));
+                    return bop->getOpcode() == BO_Add ? mBuilder.CreateAdd(l, r) : mBuilder.CreateSub(l, r);
+                case BO_Mul: return mBuilder.CreateMul(l, r);
+                case BO_Div: return mBuilder.CreateSDiv(l, r);
+                case BO_Rem: return mBuilder.CreateSRem(l, r);
+                default: return konst(-1);
+            }
+        }
+        llvm::Value *call(CallExpr *callexpr) {
+            FunctionDecl *callee = callexpr->getDirectCallee();
+            if(!callee) return fail();
+            if(callee == mEnv.getInput()) return callback((const void *)&jitGet, true, {});
+            if(callee == mEnv.getOutput()) return callback((const void *)&jitPrint, false, {expr(callexpr->getArg(0))});
+            if(callee == mEnv.getMalloc()) return callback((const void *)&jitMalloc, true, {expr(callexpr->getArg(0))});
+            if(callee == mEnv.getFree()) return callback((const void *)&jitFree, false, {expr(callexpr->getArg(0))});
+            std::vector<llvm::Value *> args;
+            for(unsigned i = 0; i < callexpr->getNumArgs(); i++) args.push_back(expr(callexpr->getArg(i)));
+            FunctionDecl *def = callee->getDefinition();
+            if(!def) return konst(0); //没有函数体的函数返回0
+            if(mJit.recursive(def)) return fail(); //本机代码中的递归不受-stack-budget限制，留给解释器
+            args.resize(def->getNumParams(), konst(0)); //缺少的实参为0，多余的实参只求值
+            return mBuilder.CreateCall(function(def), args);
+        }
+        llvm::Value *expr(Expr *exp) {
+            if(!mOk) return konst(0);
+            Expr *e = Environment::strip(exp);
+            if(IntegerLiteral *i = dyn_cast<IntegerLiteral>(e)) {
+                return konst((long)i->getValue().getSExtValue());
+            } else if(CharacterLiteral *i = dyn_cast<CharacterLiteral>(e)) {
+                return konst(i->getValue());
+            } else if(DeclRefExpr *i = dyn_cast<DeclRefExpr>(e)) {
+                VarDecl *vd = varOf(i);
+                return vd ? load(vd) : konst(0);
+            } else if(UnaryExprOrTypeTraitExpr *i = dyn_cast<UnaryExprOrTypeTraitExpr>(e)) {
+                return konst(mEnv.getLayout().sizes.lookup(i));
+            } else if(BinaryOperator *i = dyn_cast<BinaryOperator>(e)) {
+                return binop(i);
+            } else if(UnaryOperator *i = dyn_cast<UnaryOperator>(e)) {
+                llvm::Value *val = expr(i->getSubExpr());
+                if(i->getOpcode() == UO_Plus) return val;
+                if(i->getOpcode() == UO_Minus) return mBuilder.CreateNeg(val);
+                if(i->getOpcode() == UO_Deref) {
+                    MemType type = memTypeOf(i);
+                    return callback((const void *)&jitLoad, true, {val, konst(type.size), konst(type.isSigned)});
+                }
+                return konst(-1);
+            } else if(ArraySubscriptExpr *i = dyn_cast<ArraySubscriptExpr>(e)) {
+                llvm::Value *index = expr(i->getIdx());
+                VarDecl *base = varOf(i->getLHS()->IgnoreImpCasts());
+                return base ? loadElement(load(base), index, memTypeOf(i)) : konst(0);
+            } else if(CallExpr *i = dyn_cast<CallExpr>(e)) {
+                return call(i);
+            }
+            return konst(-1);
+        }
+
+        void ret(llvm::Value *val) {
+            if(!mRetPtr) {
+                mBuilder.CreateRet(val);
+                return;
+            }
+            mBuilder.CreateStore(val, mRetPtr);
+            leaveLoop(1);
+        }
+        //循环的三个部分：条件、主体、自增；enterAtBody时从主体开始（条件已在解释器中求过）
+        void loop(Expr *cond, Stmt *body, Expr *inc, bool enterAtBody) {
+            llvm::BasicBlock *head = block("cond"), *entry = block("body"), *latch = block("inc"), *exit = block("exit");
+            branch(enterAtBody ? entry : head);
+            mBuilder.SetInsertPoint(head);
+            if(cond) mBuilder.CreateCondBr(truth(expr(cond)), entry, exit);
+            else mBuilder.CreateBr(entry);
+            mBuilder.SetInsertPoint(entry);
+            stmt(body);
+            branch(latch);
+            mBuilder.SetInsertPoint(latch);
+            if(inc) expr(inc);
+            mBuilder.CreateBr(head);
+            mBuilder.SetInsertPoint(exit);
+        }
+        void vardecl(VarDecl *vd) {
+            const Type *type = vd->getType().getTypePtr();
+            llvm::Value *val = konst(0);
+            if(Environment::hasScalarInit(vd)) {
+                val = expr(vd->getInit());
+            } else if(type->isArrayType()) {
+                const VarSlot *slot = mEnv.slotOf(vd);
+                if(!slot || !mArrays) return (void)fail();
+                val = mBuilder.CreatePtrToInt(mBuilder.CreateGEP(mI64, mArrays, konst(slot->array)), mI64);
+            }
+            mBuilder.CreateStore(val, address(vd));
+        }
+        void stmt(Stmt *s) {
+            if(!mOk || !s) return;
+            reachable();
+            if(CompoundStmt *block = dyn_cast<CompoundStmt>(s)) {
+                for(Stmt *child : block->body()) stmt(child);
+            } else if(DeclStmt *ds = dyn_cast<DeclStmt>(s)) {
+                for(DeclStmt::decl_iterator it = ds->decl_begin(), ie = ds->decl_end(); it != ie; ++it)
+                    if(VarDecl *vd = dyn_cast<VarDecl>(*it)) vardecl(vd);
+            } else if(IfStmt *is = dyn_cast<IfStmt>(s)) {
+                llvm::BasicBlock *then = block("then"), *other = block("else"), *merge = block("endif");
+                mBuilder.CreateCondBr(truth(expr(is->getCond())), then, other);
+                mBuilder.SetInsertPoint(then);
+                stmt(is->getThen());
+                branch(merge);
+                mBuilder.SetInsertPoint(other);
+                stmt(is->getElse());
+                branch(merge);
+                mBuilder.SetInsertPoint(merge);
+            } else if(WhileStmt *ws = dyn_cast<WhileStmt>(s)) {
+                loop(ws->getCond(), ws->getBody(), NULL, false);
+            } else if(ForStmt *fs = dyn_cast<ForStmt>(s)) {
+                stmt(fs->getInit());
+                loop(fs->getCond(), fs->getBody(), fs->getInc(), false);
+            } else if(ReturnStmt *rs = dyn_cast<ReturnStmt>(s)) {
+                ret(rs->getRetValue() ? expr(rs->getRetValue()) : konst(0));
+            } else if(Expr *e = dyn_cast<Expr>(s)) {
+                expr(e);
+            } else if(!isa<NullStmt>(s)) fail(); //break、continue、do、switch等暂不支持
+        }
+
+        //把循环用到的局部变量写回栈帧并返回：0为循环正常结束，1为执行了return
+        void leaveLoop(long status) {
+            for(VarDecl *vd : mLoopVars)
+                mBuilder.CreateStore(mBuilder.CreateLoad(mI64, mLocals[vd]), mBuilder.CreateGEP(mI64, mSlots, konst(mEnv.slotOf(vd)->index)));
+            mBuilder.CreateRet(konst(status));
+        }
+        void defineFunction(FunctionDecl *def, llvm::Function *fn) {
+            mBuilder.SetInsertPoint(llvm::BasicBlock::Create(mCtx, "entry", fn));
+            mLocals.clear();
+            mRetPtr = NULL;
+            std::map<VarDecl *, int> locals;
+            for(unsigned i = 0; i < def->getNumParams(); i++) locals[def->getParamDecl(i)] = i;
+            LocalCollector(locals).TraverseStmt(def->getBody());
+            for(auto &local : locals) { //与解释器一样，局部变量的初值为0
+                llvm::Value *slot = mBuilder.CreateAlloca(mI64);
+                mBuilder.CreateStore(konst(0), slot);
+                mLocals[local.first] = slot;
+            }
+            llvm::Function::arg_iterator arg = fn->arg_begin();
+            for(unsigned i = 0; i < def->getNumParams(); i++, ++arg) mBuilder.CreateStore(&*arg, mLocals[def->getParamDecl(i)]);
+            FrameLayout layout = mEnv.layoutOf(def);
+            mArrays = NULL;
+            if(layout.arrayWords) mArrays = mBuilder.CreateAlloca(mI64, konst(layout.arrayWords));
+            stmt(def->getBody());
+            reachable();
+            mBuilder.CreateRet(konst(0)); //函数末尾没有return时返回0
+        }
+
+    public:
+        IRGen(Jit &jit, llvm::LLVMContext &ctx, llvm::Module &module) : mJit(jit), mEnv(jit.mEnv), mCtx(ctx), mModule(module), mBuilder(ctx), mI64(llvm::Type::getInt64Ty(ctx)), mP64(llvm::Type::getInt64PtrTy(ctx)), mFuncs(), mPending(), mLocals(), mArrays(NULL), mRetPtr(NULL), mLoopVars(), mSlots(NULL), mOk(true) {}
+
+        //long entry(long *args)：从解释器的值栈取实参调用函数本体
+        std::string entry(FunctionDecl *def) {
+            llvm::FunctionCallee body = function(def);
+            std::string name = mJit.name("entry");
+            llvm::Function *fn = llvm::Function::Create(llvm::FunctionType::get(mI64, {mP64}, false), llvm::Function::ExternalLinkage, name, &mModule);
+            mBuilder.SetInsertPoint(llvm::BasicBlock::Create(mCtx, "entry", fn));
+            std::vector<llvm::Value *> args;
+            for(unsigned i = 0; i < def->getNumParams(); i++) args.push_back(mBuilder.CreateLoad(mI64, mBuilder.CreateGEP(mI64, &*fn->arg_begin(), konst(i))));
+            mBuilder.CreateRet(mBuilder.CreateCall(body, args));
+            return name;
+        }
+        //long loop(long *slots, long *arrays, long *ret)：在解释器栈帧上从循环主体开始继续执行
+        std::string loopEntry(Stmt *s) {
+            std::string name = mJit.name("loop");
+            llvm::Function *fn = llvm::Function::Create(llvm::FunctionType::get(mI64, {mP64, mP64, mP64}, false), llvm::Function::ExternalLinkage, name, &mModule);
+            llvm::Function::arg_iterator arg = fn->arg_begin();
+            mSlots = &*arg++;
+            mArrays = &*arg++;
+            mRetPtr = &*arg;
+            mBuilder.SetInsertPoint(llvm::BasicBlock::Create(mCtx, "entry", fn));
+            LoopLocals(mEnv, mLoopVars).TraverseStmt(s);
+            for(VarDecl *vd : mLoopVars) {
+                llvm::Value *slot = mBuilder.CreateAlloca(mI64);
+                mBuilder.CreateStore(mBuilder.CreateLoad(mI64, mBuilder.CreateGEP(mI64, mSlots, konst(mEnv.slotOf(vd)->index))), slot);
+                mLocals[vd] = slot;
+            }
+            if(WhileStmt *ws = dyn_cast<WhileStmt>(s)) loop(ws->getCond(), ws->getBody(), NULL, true);
+            else if(ForStmt *fs = dyn_cast<ForStmt>(s)) loop(fs->getCond(), fs->getBody(), fs->getInc(), true);
+            else fail();
+            leaveLoop(0);
+            return name;
+        }
+        //生成所有被调函数，全部成功时返回true
+        bool finish() {
+            while(mOk && !mPending.empty()) {
+                std::pair<FunctionDecl *, llvm::Function *> next = mPending.back();
+                mPending.pop_back();
+                defineFunction(next.first, next.second);
+            }
+            return mOk;
+        }
+        const llvm::DenseMap<FunctionDecl *, llvm::Function *> &getFunctions() const { return mFuncs; }
+    };
+
+    Environment &mEnv;
+    unsigned mCallThreshold, mLoopThreshold;
+    std::unique_ptr<llvm::orc::LLJIT> mJIT; //创建失败时为NULL，一直解释执行
+    unsigned mNames;
+    llvm::DenseMap<FunctionDecl *, unsigned> mCalls;
+    llvm::DenseMap<Stmt *, unsigned> mTrips;
+    llvm::DenseMap<FunctionDecl *, FunctionEntry> mEntries;
+    llvm::DenseMap<FunctionDecl *, uint64_t> mNative; //已编译函数本体的地址，供之后的模块直接调用
+    llvm::DenseMap<Stmt *, LoopEntry> mLoops;
+    llvm::DenseSet<const void *> mFailed; //无法编译的函数与循环
+    llvm::DenseMap<FunctionDecl *, bool> mRecursive; //规范声明 -> 是否在调用环上
+
+    std::string name(const char *kind) { return std::string("__jit_") + kind + std::to_string(mNames++); }
+    uint64_t lookup(const std::string &symbol) {
+        llvm::Expected<llvm::JITEvaluatedSymbol> sym = mJIT->lookup(symbol);
+        if(!sym) {
+            llvm::consumeError(sym.takeError());
+            return 0;
+        }
+        return sym->getAddress();
+    }
+    //def能否经直接调用回到自身
+    bool recursive(FunctionDecl *def) {
+        FunctionDecl *canon = def->getCanonicalDecl();
+        llvm::DenseMap<FunctionDecl *, bool>::iterator it = mRecursive.find(canon);
+        if(it != mRecursive.end()) return it->second;
+        llvm::DenseSet<FunctionDecl *> seen;
+        std::vector<FunctionDecl *> work(1, def), callees;
+        bool found = false;
+        while(!work.empty() && !found) {
+            FunctionDecl *f = work.back();
+            work.pop_back();
+            callees.clear();
+            Callees(callees).TraverseStmt(f->getBody());
+            for(FunctionDecl *callee : callees) {
+                if(callee->getCanonicalDecl() == canon) found = true;
+                else if(seen.insert(callee->getCanonicalDecl()).second) work.push_back(callee);
+            }
+        }
+        mRecursive[canon] = found;
+        return found;
+    }
+    //优化并编译模块，记下其中各函数本体的地址，返回symbol的地址
+    uint64_t emit(std::unique_ptr<llvm::LLVMContext> ctx, std::unique_ptr<llvm::Module> module, const IRGen &gen, const std::string &symbol) {
+        if(llvm::verifyModule(*module)) return 0;
+        llvm::legacy::FunctionPassManager fpm(module.get());
+        fpm.add(llvm::createPromoteMemoryToRegisterPass());
+        fpm.add(llvm::createInstructionCombiningPass());
+        fpm.add(llvm::createReassociatePass());
+        fpm.add(llvm::createGVNPass());
+        fpm.add(llvm::createCFGSimplificationPass());
+        fpm.doInitialization();
+        for(llvm::Function &fn : *module) fpm.run(fn);
+        fpm.doFinalization();
+        std::vector<std::pair<FunctionDecl *, std::string> > defined;
+        for(auto &fn : gen.getFunctions()) defined.push_back(std::make_pair(fn.first, fn.second->getName().str()));
+        if(llvm::Error err = mJIT->addIRModule(llvm::orc::ThreadSafeModule(std::move(module), std::move(ctx)))) {
+            llvm::consumeError(std::move(err));
+            return 0;
+        }
+        for(auto &fn : defined) if(uint64_t addr = lookup(fn.second)) mNative[fn.first] = addr;
+        return lookup(symbol);
+    }
+    FunctionEntry compileFunction(FunctionDecl *def) {
+        std::unique_ptr<llvm::LLVMContext> ctx(new llvm::LLVMContext());
+        std::unique_ptr<llvm::Module> module(new llvm::Module("jit", *ctx));
+        IRGen gen(*this, *ctx, *module);
+        std::string symbol = gen.entry(def);
+        if(!gen.finish()) return NULL;
+        return (FunctionEntry)(uintptr_t)emit(std::move(ctx), std::move(module), gen, symbol);
+    }
+    LoopEntry compileLoop(Stmt *loop) {
+        std::unique_ptr<llvm::LLVMContext> ctx(new llvm::LLVMContext());
+        std::unique_ptr<llvm::Module> module(new llvm::Module("jit", *ctx));
+        IRGen gen(*this, *ctx, *module);
+        std::string symbol = gen.loopEntry(loop);
+        if(!gen.finish()) return NULL;
+        return (LoopEntry)(uintptr_t)emit(std::move(ctx), std::move(module), gen, symbol);
+    }
+
+public:
+    Jit(Environment &env, unsigned callThreshold, unsigned loopThreshold) : mEnv(env), mCallThreshold(callThreshold), mLoopThreshold(loopThreshold), mJIT(), mNames(0) {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+        llvm::Expected<std::unique_ptr<llvm::orc::LLJIT> > jit = llvm::orc::LLJITBuilder().create();
+        if(jit) mJIT = std::move(*jit);
+        else llvm::consumeError(jit.takeError());
+    }
+
+    virtual FunctionEntry function(FunctionDecl *callee) {
+        FunctionDecl *canon = callee->getCanonicalDecl();
+        llvm::DenseMap<FunctionDecl *, FunctionEntry>::iterator it = mEntries.find(canon);
+        if(it != mEntries.end()) return it->second;
+        FunctionDecl *def = callee->getDefinition();
+        if(!mJIT || !def || ++mCalls[canon] < mCallThreshold || mFailed.count(canon)) return NULL;
+        FunctionEntry entry = compileFunction(def);
+        if(entry) mEntries[canon] = entry;
+        else mFailed.insert(canon);
+        return entry;
+    }
+    virtual LoopEntry loop(Stmt *loop) {
+        llvm::DenseMap<Stmt *, LoopEntry>::iterator it = mLoops.find(loop);
+        if(it != mLoops.end()) return it->second;
+        if(!mJIT || ++mTrips[loop] < mLoopThreshold || mFailed.count(loop)) return NULL;
+        LoopEntry entry = compileLoop(loop);
+        if(entry) mLoops[loop] = entry;
+        else mFailed.insert(loop);
+        return entry;
+    }
+};
+#endif /* !_JIT_H_ */
@@ -0,0 +1,223 @@
+//==--- Optimizer.h - 解释执行前的AST优化 -------------------------------===//
+//
+// 从main出发，对其及其调用到的函数就地改写AST：
+//   常量折叠：只含常量的算术、比较与sizeof折叠为一个整数常量；
+//   死分支删除：条件为常量的if语句替换为被执行的分支；
+//   循环不变量外提：循环中反复求值、结果不变的表达式在循环前求值一次，
+//   存入新建的局部变量，循环内改为引用该变量。
+// 折叠与求值规则与Environment完全一致，改写后的AST由AST遍历器和字节码编译器直接使用。
+//===----------------------------------------------------------------------===//
+#ifndef _OPTIMIZER_H_
+#define _OPTIMIZER_H_
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/Expr.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/AST/Stmt.h"
+#include "llvm/ADT/DenseSet.h"
+
+#include "Environment.h"
+
+using namespace clang;
+
+class Optimizer {
+    //循环中会被修改的变量，以及循环是否调用了可能修改全局变量的函数
+    class ModifiedVars : public RecursiveASTVisitor<ModifiedVars> {
+        llvm::DenseSet<VarDecl *> &mVars;
+        bool &mCalls;
+        void modify(Expr *e) {
+            if(DeclRefExpr *ref = dyn_cast<DeclRefExpr>(e->IgnoreParenImpCasts()))
+                if(VarDecl *vd = dyn_cast<VarDecl>(ref->getDecl())) mVars.insert(vd);
+        }
+    public:
+        ModifiedVars(llvm::DenseSet<VarDecl *> &vars, bool &calls) : mVars(vars), mCalls(calls) {}
+        bool VisitBinaryOperator(BinaryOperator *bop) {
+            if(bop->isAssignmentOp()) modify(bop->getLHS());
+            return true;
+        }
+        bool VisitUnaryOperator(UnaryOperator *uop) {
+            if(uop->isIncrementDecrementOp() || uop->getOpcode() == UO_AddrOf) modify(uop->getSubExpr());
+            return true;
+        }
+        bool VisitVarDecl(VarDecl *vd) {
+            mVars.insert(vd); //循环内声明的变量每次迭代重新初始化
+            return true;
+        }
+        bool VisitCallExpr(CallExpr *call) {
+            FunctionDecl *callee = call->getDirectCallee();
+            if(!callee || callee->hasBody() || callee->getDefinition()) mCalls = true;
+            return true;
+        }
+    };
+
+    ASTContext &mContext;
+    FunctionDecl *mFunc; //当前正在优化的函数
+    std::vector<FunctionDecl *> mPending;
+    llvm::DenseSet<FunctionDecl *> mSeen;
+    unsigned mTemps; //已创建的外提变量个数
+
+    void reach(FunctionDecl *fd) {
+        FunctionDecl *def = fd->getDefinition();
+        if(def && mSeen.insert(def).second) mPending.push_back(def);
+    }
+    IntegerLiteral *literal(long value, SourceLocation loc) {
+        return IntegerLiteral::Create(mContext, llvm::APInt(64, (uint64_t)value, true), mContext.LongTy, loc);
+    }
+    //与Environment::expr相同的求值规则，只对不依赖运行状态的表达式成功
+    bool constant(Expr *exp, long &value) {
+        Expr *e = exp->IgnoreImpCasts();
+        if(IntegerLiteral *i = dyn_cast<IntegerLiteral>(e)) {
+            value = (long)i->getValue().getSExtValue();
+            return true;
+        } else if(CharacterLiteral *i = dyn_cast<CharacterLiteral>(e)) {
+            value = i->getValue();
+            return true;
+        } else if(ParenExpr *i = dyn_cast<ParenExpr>(e)) {
+            return constant(i->getSubExpr(), value);
+        } else if(CStyleCastExpr *i = dyn_cast<CStyleCastExpr>(e)) {
+            return constant(i->getSubExpr(), value);
+        } else if(UnaryExprOrTypeTraitExpr *i = dyn_cast<UnaryExprOrTypeTraitExpr>(e)) {
+            value = Environment::sizeofexpr(mContext, i);
+            return true;
+        } else if(UnaryOperator *i = dyn_cast<UnaryOperator>(e)) {
+            if(i->getOpcode() != UO_Plus && i->getOpcode() != UO_Minus) return false;
+            if(!constant(i->getSubExpr(), value)) return false;
+            if(i->getOpcode() == UO_Minus) value = -value;
+            return true;
+        } else if(BinaryOperator *i = dyn_cast<BinaryOperator>(e)) {
+            long left, right;
+            if(!(i->isComparisonOp() || i->isAdditiveOp() || i->isMultiplicativeOp())) return false;
+            if(!i->getType()->isIntegerType() || !i->getLHS()->getType()->isIntegerType() || !i->getRHS()->getType()->isIntegerType()) return false;
+            if(!constant(i->getLHS(), left) || !constant(i->getRHS(), right)) return false;
+            switch(i->getOpcode()) {
+                case BO_GT: value = left > right; return true;
+                case BO_LT: value = left < right; return true;
+                case BO_EQ: value = left == right; return true;
+                case BO_GE: value = left >= right; return true;
+                case BO_LE: value = left <= right; return true;
+                case BO_NE: value = left != right; return true;
+                case BO_Add: value = left + right; return true;
+                case BO_Sub: value = left - right; return true;
+                case BO_Mul: value = left * right; return true;
+                case BO_Div: case BO_Rem: //除零留到运行时
+                    if(!right) return false;
+                    value = i->getOpcode() == BO_Div ? left / right : left % right;
+                    return true;
+                default: return false;
+            }
+        }
+        return false;
+    }
+
+    //在循环中结果不变且求值没有副作用、不会出错的表达式
+    bool invariant(Expr *exp, const llvm::DenseSet<VarDecl *> &modified, bool calls) {
+        Expr *e = exp->IgnoreImpCasts();
+        if(isa<IntegerLiteral>(e) || isa<CharacterLiteral>(e)) return true;
+        if(DeclRefExpr *i = dyn_cast<DeclRefExpr>(e)) {
+            VarDecl *vd = dyn_cast<VarDecl>(i->getDecl());
+            return vd && !modified.count(vd) && !(calls && vd->hasGlobalStorage());
+        } else if(ParenExpr *i = dyn_cast<ParenExpr>(e)) {
+            return invariant(i->getSubExpr(), modified, calls);
+        } else if(UnaryOperator *i = dyn_cast<UnaryOperator>(e)) {
+            return (i->getOpcode() == UO_Plus || i->getOpcode() == UO_Minus) && invariant(i->getSubExpr(), modified, calls);
+        } else if(BinaryOperator *i = dyn_cast<BinaryOperator>(e)) {
+            if(!(i->isComparisonOp() || i->isAdditiveOp() || i->isMultiplicativeOp())) return false;
+            if(i->getOpcode() == BO_Div || i->getOpcode() == BO_Rem) {
+                long divisor;
+                if(!constant(i->getRHS(), divisor) || !divisor) return false;
+            }
+            return invariant(i->getLHS(), modified, calls) && invariant(i->getRHS(), modified, calls);
+        }
+        return false;
+    }
+    //值得外提的表达式：至少有一次运算且引用了变量
+    bool worthHoisting(Expr *exp) {
+        Expr *e = exp->IgnoreParenImpCasts();
+        if(!isa<BinaryOperator>(e) && !isa<UnaryOperator>(e)) return false;
+        long value;
+        return !constant(e, value);
+    }
+
+    //把循环中最大的不变子表达式替换为对新局部变量的引用，变量声明追加到decls
+    void hoist(Stmt *&s, const llvm::DenseSet<VarDecl *> &modified, bool calls, std::vector<Stmt *> &decls) {
+        if(!s || isa<UnaryExprOrTypeTraitExpr>(s)) return;
+        if(Expr *e = dyn_cast<Expr>(s)) {
+            if(worthHoisting(e) && invariant(e, modified, calls)) {
+                SourceLocation loc = e->getBeginLoc();
+                std::string name = "__invariant" + std::to_string(mTemps++);
+                VarDecl *vd = VarDecl::Create(mContext, mFunc, loc, loc, &mContext.Idents.get(name), e->getType(), mContext.getTrivialTypeSourceInfo(e->getType(), loc), SC_None);
+                vd->setInit(e);
+                decls.push_back(new (mContext) DeclStmt(DeclGroupRef(vd), loc, loc));
+                s = new (mContext) DeclRefExpr(mContext, vd, false, e->getType(), VK_LValue, loc);
+                return;
+            }
+            if(BinaryOperator *bop = dyn_cast<BinaryOperator>(e)) //被赋值的变量本身不能替换
+                if(bop->isAssignmentOp() && isa<DeclRefExpr>(bop->getLHS()->IgnoreParenImpCasts())) {
+                    hoist(*(std::next(bop->child_begin())), modified, calls, decls);
+                    return;
+                }
+        }
+        for(Stmt *&child : s->children()) hoist(child, modified, calls, decls);
+    }
+    //外提循环loop中的不变量，需要时把循环替换为{不变量声明; 循环}
+    Stmt *hoistLoop(Stmt *loop, std::vector<Stmt *> parts) {
+        llvm::DenseSet<VarDecl *> modified;
+        bool calls = false;
+        ModifiedVars collector(modified, calls);
+        for(Stmt *part : parts) if(part) collector.TraverseStmt(part);
+        std::vector<Stmt *> stmts;
+        for(Stmt *&child : loop->children())
+            if(std::find(parts.begin(), parts.end(), child) != parts.end() && (!isa<ForStmt>(loop) || child != cast<ForStmt>(loop)->getInit()))
+                hoist(child, modified, calls, stmts);
+        if(stmts.empty()) return loop;
+        stmts.push_back(loop);
+        return CompoundStmt::Create(mContext, stmts, loop->getBeginLoc(), loop->getEndLoc());
+    }
+
+    //后序改写s，返回替换它的语句
+    Stmt *rewrite(Stmt *s) {
+        if(Expr *e = dyn_cast<Expr>(s)) {
+            long value;
+            //只折叠整数类型的表达式，指针运算依赖操作数的类型
+            if(e->getType()->isIntegerType() && !isa<IntegerLiteral>(e->IgnoreImpCasts()) && !isa<CharacterLiteral>(e->IgnoreImpCasts()) && constant(e, value))
+                return literal(value, e->getBeginLoc());
+        }
+        if(isa<UnaryExprOrTypeTraitExpr>(s)) return s;
+        if(CallExpr *call = dyn_cast<CallExpr>(s))
+            if(FunctionDecl *callee = call->getDirectCallee()) reach(callee);
+        for(Stmt *&child : s->children()) if(child) child = rewrite(child);
+        if(IfStmt *ifstmt = dyn_cast<IfStmt>(s)) {
+            long value;
+            if(!ifstmt->getInit() && !ifstmt->getConditionVariable() && constant(ifstmt->getCond(), value)) {
+                if(value) return ifstmt->getThen();
+                if(ifstmt->getElse()) return ifstmt->getElse();
+                return new (mContext) NullStmt(ifstmt->getBeginLoc());
+            }
+        } else if(WhileStmt *whilestmt = dyn_cast<WhileStmt>(s)) {
+            return hoistLoop(whilestmt, {whilestmt->getCond(), whilestmt->getBody()});
+        } else if(ForStmt *forstmt = dyn_cast<ForStmt>(s)) {
+            return hoistLoop(forstmt, {forstmt->getInit(), forstmt->getCond(), forstmt->getInc(), forstmt->getBody()});
+        }
+        return s;
+    }
+
+public:
+    explicit Optimizer(ASTContext &context) : mContext(context), mFunc(NULL), mPending(), mSeen(), mTemps(0) {}
+
+    //优化main及其直接或间接调用的函数
+    void run(TranslationUnitDecl *unit) {
+        for(TranslationUnitDecl::decl_iterator i = unit->decls_begin(), e = unit->decls_end(); i != e; ++i)
+            if(FunctionDecl *fdecl = dyn_cast<FunctionDecl>(*i))
+                if(fdecl->getName().equals("main")) reach(fdecl);
+        while(!mPending.empty()) {
+            mFunc = mPending.back();
+            mPending.pop_back();
+            mFunc->setBody(rewrite(mFunc->getBody()));
+        }
+    }
+};
+#endif /* !_OPTIMIZER_H_ */
@@ -0,0 +1,147 @@
+//==--- Profiler.h - 解释执行的性能剖析 ---------------------------------===//
+//
+// 由Environment在开启剖析时调用，关闭时解释器只多一次空指针判断。
+// 记录每条语句的执行次数（按源码行汇总）、每个函数的调用次数与包含时间、
+// 每个循环的进入次数与迭代次数，并以调用路径为键累计各路径的自身时间，
+// 按折叠栈格式（"main;f;g 纳秒数"）输出，可直接交给flamegraph.pl等工具。
+//===----------------------------------------------------------------------===//
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "clang/AST/Decl.h"
+#include "clang/AST/Stmt.h"
+#include "clang/Basic/SourceManager.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/raw_ostream.h"
+
+class Profiler {
+    typedef std::chrono::steady_clock Clock;
+    //调用树的节点，对应一条从main开始的调用路径
+    struct Node {
+        unsigned parent;
+        clang::FunctionDecl *func;
+        uint64_t selfNs;
+        llvm::DenseMap<clang::FunctionDecl *, unsigned> children;
+    };
+    struct Frame {
+        unsigned node;
+        Clock::time_point start;
+        uint64_t childNs; //被调函数占用的时间，用于求自身时间
+    };
+    struct FuncStats {
+        uint64_t calls;
+        uint64_t inclusiveNs;
+        unsigned active; //在调用栈上的层数，递归时只在最外层累计包含时间
+    };
+    struct LoopStats {
+        uint64_t entries;
+        uint64_t trips;
+    };
+    std::vector<Node> mNodes; //mNodes[0]为根
+    std::vector<Frame> mFrames;
+    llvm::DenseMap<clang::Stmt *, uint64_t> mStmts;
+    llvm::DenseMap<clang::FunctionDecl *, FuncStats> mFuncs;
+    llvm::DenseMap<clang::Stmt *, LoopStats> mLoops;
+
+    static uint64_t since(Clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+    void path(unsigned node, std::string &out) const {
+        if(!node) return;
+        path(mNodes[node].parent, out);
+        if(mNodes[node].parent) out += ';';
+        out += mNodes[node].func->getName().str();
+    }
+    //按出现顺序输出语句，位置相同时保持稳定
+    template <class T>
+    static std::vector<std::pair<clang::Stmt *, T> > sorted(const llvm::DenseMap<clang::Stmt *, T> &map, const clang::SourceManager &sm) {
+        std::vector<std::pair<clang::Stmt *, T> > items(map.begin(), map.end());
+        std::stable_sort(items.begin(), items.end(), [&sm](const std::pair<clang::Stmt *, T> &a, const std::pair<clang::Stmt *, T> &b) {
+            return sm.isBeforeInTranslationUnit(a.first->getBeginLoc(), b.first->getBeginLoc());
+        });
+        return items;
+    }
+
+public:
+    Profiler() : mNodes(1, Node{0, NULL, 0, {}}), mFrames(1, Frame{0, Clock::now(), 0}), mStmts(), mFuncs(), mLoops() {}
+
+    void stmt(clang::Stmt *s) { mStmts[s]++; }
+    void loopEntry(clang::Stmt *loop) { mLoops[loop].entries++; }
+    void loopTrip(clang::Stmt *loop) { mLoops[loop].trips++; }
+
+    void enter(clang::FunctionDecl *f) {
+        f = f->getCanonicalDecl();
+        unsigned parent = mFrames.back().node;
+        unsigned &child = mNodes[parent].children[f];
+        if(!child) {
+            child = mNodes.size();
+            mNodes.push_back(Node{parent, f, 0, {}});
+        }
+        mFrames.push_back(Frame{child, Clock::now(), 0});
+        FuncStats &stats = mFuncs[f];
+        stats.calls++;
+        stats.active++;
+    }
+    void exit() {
+        Frame frame = mFrames.back();
+        mFrames.pop_back();
+        uint64_t elapsed = since(frame.start);
+        Node &node = mNodes[frame.node];
+        node.selfNs += elapsed - std::min(elapsed, frame.childNs);
+        mFrames.back().childNs += elapsed;
+        FuncStats &stats = mFuncs[node.func];
+        if(--stats.active == 0) stats.inclusiveNs += elapsed;
+    }
+
+    //执行过的语句与函数调用的总次数，供-bench计算吞吐量
+    uint64_t totalStmts() const {
+        uint64_t total = 0;
+        for(auto &s : mStmts) total += s.second;
+        return total;
+    }
+    uint64_t totalCalls() const {
+        uint64_t total = 0;
+        for(auto &f : mFuncs) total += f.second.calls;
+        return total;
+    }
+
+    //折叠栈：每行一条调用路径及其自身时间（纳秒）
+    void writeCollapsed(llvm::raw_ostream &os) const {
+        for(unsigned i = 1; i < mNodes.size(); i++) {
+            if(!mNodes[i].selfNs) continue;
+            std::string stack;
+            path(i, stack);
+            os << stack << ' ' << mNodes[i].selfNs << '\n';
+        }
+    }
+    void writeSummary(llvm::raw_ostream &os, const clang::SourceManager &sm) const {
+        os << "# functions: name calls inclusive_ns\n";
+        std::map<std::string, const FuncStats *> funcs;
+        for(auto &f : mFuncs) funcs[f.first->getName().str()] = &f.second;
+        for(auto &f : funcs) os << f.first << ' ' << f.second->calls << ' ' << f.second->inclusiveNs << '\n';
+
+        std::vector<std::pair<clang::Stmt *, uint64_t> > stmts = sorted(mStmts, sm);
+        os << "# lines: line count\n";
+        std::map<unsigned, uint64_t> lines;
+        for(auto &s : stmts) lines[sm.getSpellingLineNumber(s.first->getBeginLoc())] += s.second;
+        for(auto &l : lines) os << l.first << ' ' << l.second << '\n';
+        os << "# statements: line:column kind count\n";
+        for(auto &s : stmts) {
+            clang::SourceLocation loc = s.first->getBeginLoc();
+            os << sm.getSpellingLineNumber(loc) << ':' << sm.getSpellingColumnNumber(loc) << ' ' << s.first->getStmtClassName() << ' ' << s.second << '\n';
+        }
+        os << "# loops: line:column kind entries trips\n";
+        for(auto &l : sorted(mLoops, sm)) {
+            clang::SourceLocation loc = l.first->getBeginLoc();
+            os << sm.getSpellingLineNumber(loc) << ':' << sm.getSpellingColumnNumber(loc) << ' ' << l.first->getStmtClassName() << ' ' << l.second.entries << ' ' << l.second.trips << '\n';
+        }
+    }
+};
+#endif /* !_PROFILER_H_ */
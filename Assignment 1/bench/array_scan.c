@@ -0,0 +1,31 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+char sieve[20000];
+int prefix[20000];
+
+int main() {
+    int n;
+    int i;
+    int j;
+    int count;
+    n = GET();
+    for (i = 0; i < n; i = i + 1) sieve[i] = 1;
+    sieve[0] = 0;
+    sieve[1] = 0;
+    for (i = 2; i * i < n; i = i + 1) {
+        if (sieve[i]) {
+            for (j = i * i; j < n; j = j + i) sieve[j] = 0;
+        }
+    }
+    count = 0;
+    for (i = 0; i < n; i = i + 1) {
+        count = count + sieve[i];
+        prefix[i] = count;
+    }
+    PRINT(prefix[n - 1]);
+    PRINT(prefix[n / 2]);
+    return 0;
+}
@@ -0,0 +1,19 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+    int n;
+    int i;
+    int x;
+    long total;
+    n = GET();
+    total = 0;
+    for (i = 0; i < n; i = i + 1) {
+        x = GET();
+        total = total + x;
+        PRINT(total);
+    }
+    return 0;
+}
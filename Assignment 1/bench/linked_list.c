@@ -0,0 +1,37 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+long *push(long *head, long value) {
+    long *node;
+    node = (long *)MALLOC(2 * sizeof(long));
+    *node = value;
+    *(node + 1) = (long)head;
+    return node;
+}
+
+int main() {
+    int n;
+    int i;
+    int round;
+    long sum;
+    long *head;
+    long *p;
+    long *next;
+    n = GET();
+    sum = 0;
+    for (round = 0; round < 10; round = round + 1) {
+        head = 0;
+        for (i = 0; i < n; i = i + 1) head = push(head, i + round);
+        p = head;
+        while (p != 0) {
+            sum = sum + *p;
+            next = (long *)*(p + 1);
+            FREE(p);
+            p = next;
+        }
+    }
+    PRINT(sum);
+    return 0;
+}
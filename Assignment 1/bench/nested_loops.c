@@ -0,0 +1,23 @@
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+    int n;
+    int i;
+    int j;
+    int k;
+    long sum;
+    n = GET();
+    sum = 0;
+    for (i = 0; i < n; i = i + 1) {
+        for (j = 0; j < n; j = j + 1) {
+            for (k = 1; k < n; k = k + 1) {
+                sum = sum + (i * j) % k;
+            }
+        }
+    }
+    PRINT(sum);
+    return 0;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# 解释器基准测试：对本目录下每个.c程序运行ASTInterpreter -bench，每个程序输出一行JSON
+# 用法：run.sh <ASTInterpreter路径> [迭代次数] [传给解释器的其他选项，例如 -vm、-closures、-jit]
+# 同名的.in文件为程序的GET输入；结果可重定向到文件，与之前的结果逐行比较以发现性能回退
+set -e
+if [ $# -lt 1 ]; then
+    echo "usage: $0 <ASTInterpreter> [iterations] [interpreter options...]" >&2
+    exit 1
+fi
+interp=$1
+iterations=${2:-5}
+[ $# -ge 2 ] && shift 2 || shift 1
+dir=$(dirname "$0")
+for prog in "$dir"/*.c; do
+    input=${prog%.c}.in
+    [ -f "$input" ] || input=/dev/null
+    "$interp" -f "$prog" -input "$input" -bench "$iterations" "$@"
+done
@@ -12,9 +12,17 @@
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Utils.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/ADT/BitVector.h>
+#include <llvm/Support/ThreadPool.h>
+#include <algorithm>
 #include <list>
 #include <map>
+#include <memory>
+#include <set>
+#include <tuple>
+#include <vector>
 #include <llvm/Transforms/Scalar/SimplifyCFG.h>
+#include "LazyModule.h"
 
 using namespace llvm;
 static ManagedStatic<LLVMContext> GlobalContext;
@@ -28,119 +36,201 @@ struct EnableFunctionOptPass: public FunctionPass {
     }
 };
 char EnableFunctionOptPass::ID = 0;
+static cl::opt<unsigned> Jobs("j", cl::desc("Resolve indirect calls on <n> threads, splitting functions between them (0 = one per hardware thread)"), cl::value_desc("n"), cl::init(1));
+// Function pointer values are solved as inclusion constraints. Each node (a value, or the
+// return value of some function at some call site) holds a set of functions, and an edge
+// src -> dst means dst includes src. Nodes are created on first use and memoized. The result
+// of an indirect call depends on the callee's set: every new function in it fires a trigger
+// that creates the matching return value node and links it. Creation and propagation run on
+// explicit worklists, so cycles iterate to a fixpoint.
+// Because nodes are memoized, each diagnostic ("ERROR here", "UNIMPLEMNTED", ...) is printed
+// once per node, not once every time the node is reached as the recursive walk this replaced
+// did; a function pointer loaded once and called twice reports its error once.
+// Functions are numbered up front and sets are bit vectors indexed by that number.
+// The module is indexed once before solving (return values, indirect calls through
+// arguments, uses of each function); solving only does lookups.
+// The index is read-only. With -j above 1 the functions are split over a thread pool and each
+// thread solves its indirect calls with its own Solver; the results match the serial run.
+// Diagnostics are recorded on nodes and printed after solving in module order of the calls.
 struct FuncPtrPass : public ModulePass {
     static char ID;
     FuncPtrPass() : ModulePass(ID) {}
-	std::map<int, std::list<Function*>> result;
-    bool runOnModule(Module &M) override {
-		for(Module::iterator i = M.begin(); i != M.end(); i++) {
-			for(Function::iterator j = i->begin(); j != i->end(); j++) {
-				for(BasicBlock::iterator k = j->begin(); k != j->end(); k++) {
-					if(CallInst *callInst = dyn_cast<CallInst>(k)) {
-						int line = callInst->getDebugLoc().getLine();
-						if(Function *func = callInst->getCalledFunction()) result[line].push_back(func);
-						else if(Value *value = callInst->getCalledOperand()) result[line].splice(result[line].end(), std::list<Function*>(solveValue(value)));
-						else errs() << "ERROR\n";
-					}
+	enum : unsigned { RET = ~0u };
+	// How a function is used
+	struct FuncUses {
+		std::vector<CallInst*> calls; // direct calls to it
+		std::vector<CallInst*> passedTo; // calls passing it as an argument
+		unsigned others; // any other use, e.g. stored to memory
+	};
+	std::vector<Function*> funcList; // id -> function
+	DenseMap<Function*, unsigned> funcIds;
+	DenseMap<Function*, std::vector<Value*>> returnVals;
+	// (function, argument number) -> calls in the function whose callee is that argument. Keyed by number so
+	// solver threads never call Function::getArg, which may build a declaration's argument list
+	DenseMap<std::pair<Function*, unsigned>, std::vector<CallInst*>> argCalls;
+	DenseMap<Function*, FuncUses> funcUses;
+	DenseMap<CallInst*, BitVector> result;
+
+	// Identifies a node across Solvers; used to print each diagnostic once
+	typedef std::tuple<Value*, CallInst*, Function*, BasicBlock*, unsigned> NodeKey;
+	// All state of one solve
+	struct Solver {
+		// When function f appears in the watched node, node (call, f, tag, block) is linked to target
+		struct Trigger {
+			CallInst *call;
+			BasicBlock *block;
+			unsigned tag;
+			unsigned target;
+			unsigned input; // index into target's inputs
+		};
+		struct Node {
+			Value *value; // value node
+			CallInst *caller; // context node: func called at caller; the return value of func if tag is RET, else argument tag of the calls in func whose callee is argument tag
+			Function *func;
+			BasicBlock *block;
+			unsigned tag;
+			BitVector funcs;
+			BitVector delta; // functions not yet propagated to succ
+			std::vector<unsigned> succ;
+			std::set<unsigned> succSet;
+			std::vector<Trigger> triggers;
+			std::vector<unsigned> inputs; // nodes linked to this one by its expansion, in order
+			std::vector<std::tuple<unsigned, unsigned, unsigned>> fired; // (input index, function id, node) linked to this one by fired triggers
+			std::vector<const char*> diags;
+		};
+		const FuncPtrPass &index;
+		std::vector<std::pair<CallInst*, unsigned>> roots; // indirect calls to solve and the nodes of their callees
+		std::vector<Node> nodes;
+		DenseMap<Value*, unsigned> valueNodes;
+		std::map<std::tuple<CallInst*, Function*, BasicBlock*, unsigned>, unsigned> contextNodes;
+		std::vector<unsigned> expandList, propagateList;
+
+		Solver(const FuncPtrPass &index) : index(index) {}
+		void diag(unsigned id, const char *msg) { nodes[id].diags.push_back(msg); }
+		unsigned newNode(Value *value, CallInst *caller, Function *func, BasicBlock *block, unsigned tag) {
+			nodes.push_back(Node{value, caller, func, block, tag, BitVector(index.funcList.size()), BitVector(index.funcList.size()), {}, {}, {}, {}, {}, {}});
+			expandList.push_back(nodes.size() - 1);
+			return nodes.size() - 1;
+		}
+		unsigned valueNode(Value *value) {
+			auto it = valueNodes.find(value);
+			if(it != valueNodes.end()) return it->second;
+			unsigned id = newNode(value, nullptr, nullptr, nullptr, 0);
+			valueNodes[value] = id;
+			return id;
+		}
+		unsigned contextNode(CallInst *caller, Function *func, BasicBlock *block, unsigned tag) {
+			auto key = std::make_tuple(caller, func, block, tag);
+			auto it = contextNodes.find(key);
+			if(it != contextNodes.end()) return it->second;
+			unsigned id = newNode(nullptr, caller, func, block, tag);
+			contextNodes[key] = id;
+			return id;
+		}
+		void addFunc(unsigned id, Function *func) {
+			BitVector funcs(index.funcList.size());
+			funcs.set(index.getId(func));
+			addFuncs(id, funcs);
+		}
+		// Adds funcs to node id; only new functions go to delta and fire triggers
+		void addFuncs(unsigned id, const BitVector &funcs) {
+			BitVector added(funcs);
+			added.reset(nodes[id].funcs);
+			if(added.none()) return;
+			nodes[id].funcs |= added;
+			if(nodes[id].delta.none()) propagateList.push_back(id);
+			nodes[id].delta |= added;
+			for(unsigned func : added.set_bits())
+				for(size_t i = 0; i < nodes[id].triggers.size(); i++) fire(nodes[id].triggers[i], index.funcList[func]); // fire may grow nodes
+		}
+		void addEdge(unsigned src, unsigned dst) {
+			if(!nodes[src].succSet.insert(dst).second) return;
+			nodes[src].succ.push_back(dst);
+			BitVector funcs(nodes[src].funcs);
+			addFuncs(dst, funcs);
+		}
+		void fire(Trigger trigger, Function *func) {
+			unsigned src = contextNode(trigger.call, func, trigger.block, trigger.tag);
+			nodes[trigger.target].fired.push_back(std::make_tuple(trigger.input, index.getId(func), src));
+			addEdge(src, trigger.target);
+		}
+		void addTrigger(unsigned id, Trigger trigger) {
+			nodes[id].triggers.push_back(trigger);
+			BitVector funcs(nodes[id].funcs);
+			for(unsigned func : funcs.set_bits()) fire(trigger, index.funcList[func]);
+		}
+		// Expanding node id links its inputs through these two, recording their order
+		void addInput(unsigned id, unsigned src) {
+			nodes[id].inputs.push_back(src);
+			addEdge(src, id);
+		}
+		void addInput(unsigned id, unsigned src, CallInst *call, BasicBlock *block, unsigned tag) {
+			nodes[id].inputs.push_back(src);
+			addTrigger(src, Trigger{call, block, tag, id, (unsigned)nodes[id].inputs.size() - 1});
+		}
+		// Create and expand all reachable nodes first, then propagate new functions along edges, until both worklists are empty
+		void solve() {
+			while(!expandList.empty() || !propagateList.empty()) {
+				if(!expandList.empty()) {
+					unsigned id = expandList.back();
+					expandList.pop_back();
+					if(nodes[id].value) expandValue(id);
+					else expandContext(id);
+					continue;
 				}
+				unsigned id = propagateList.back();
+				propagateList.pop_back();
+				BitVector delta(index.funcList.size());
+				std::swap(delta, nodes[id].delta);
+				for(size_t i = 0; i < nodes[id].succ.size(); i++) addFuncs(nodes[id].succ[i], delta);
 			}
 		}
-		for(std::map<int, std::list<Function*>>::iterator i = result.begin(); i != result.end(); i++) {
-			if(i->first == 0) continue;
-			errs() << i->first << " : ";
-			i->second.sort(); i->second.unique();
-			std::list<Function*>::iterator funcEnd = --(i->second.end());
-			for(std::list<Function*>::iterator func = i->second.begin(); func != funcEnd; ++func) errs()<<(*func)->getName()<<',';
-			errs()<<(*funcEnd)->getName()<<'\n';
-		}
-        return false;
-    }
-	std::list<Function*> solveFunction(CallInst *caller, Function *func, std::list<Value*> values, BasicBlock* basicBlock) {
-		std::list<Function*> res;
-		while(!values.empty()) {
-			Value *value = values.front();
-			if(Function *theFunc = dyn_cast<Function>(value)) {
-				res.push_back(theFunc);
-			}else if (CallInst *callInst = dyn_cast<CallInst>(value)) {
-				errs() << "UNIMPLEMNTED\n";
-			}else if(PHINode *phi = dyn_cast<PHINode>(value)) {
-				for(Value *phivalue : phi->incoming_values())
-					values.push_back(phivalue);
-			}else if(Argument *arg = dyn_cast<Argument>(value)) {
-				unsigned argIdx = arg->getArgNo();
-				BasicBlock *curBlock = caller->getParent();
-				Value *valueToSolve = caller->getArgOperand(std::move(argIdx));
-				valueToSolve = valueToSolve->DoPHITranslation(std::move(curBlock), basicBlock);
-				std::list<Function*> solveValueRes = solveValue(std::move(valueToSolve));
-				res.splice(res.end(), solveValueRes);
+
+		// Values of func's return (or of getCalledArgVal) at call site caller, with arguments replaced by caller's operands
+		void expandContext(unsigned id) {
+			CallInst *caller = nodes[id].caller;
+			BasicBlock *basicBlock = nodes[id].block;
+			std::list<Value*> values = nodes[id].tag == RET ? index.getReturnVal(nodes[id].func) : index.getCalledArgVal(nodes[id].func, nodes[id].tag);
+			std::set<Value*> seen;
+			while(!values.empty()) {
+				Value *value = values.front();
+				values.pop_front();
+				if(!seen.insert(value).second) continue;
+				if(Function *theFunc = dyn_cast<Function>(value)) {
+					addFunc(id, theFunc);
+				}else if (isa<CallInst>(value)) {
+					diag(id, "UNIMPLEMNTED\n");
+				}else if(PHINode *phi = dyn_cast<PHINode>(value)) {
+					for(Value *phivalue : phi->incoming_values())
+						values.push_back(phivalue);
+				}else if(Argument *arg = dyn_cast<Argument>(value)) {
+					if(arg->getArgNo() >= caller->getNumArgOperands()) continue;
+					Value *valueToSolve = caller->getArgOperand(arg->getArgNo());
+					valueToSolve = valueToSolve->DoPHITranslation(caller->getParent(), basicBlock);
+					addInput(id, valueNode(valueToSolve));
+				}
 			}
-			values.pop_front();
 		}
-		return res;
-	}
-	std::list<Value*> getReturnVal(Function *func) {
-		std::list<Value*> res;
-		for (Function::iterator i = func->begin(); i != func->end(); i++) if (ReturnInst *ret = dyn_cast<ReturnInst>(i->getTerminator())) res.push_back(ret->getReturnValue());
-		return res;
-	}
-	std::list<Function*> solveValue(Value *origin) {
-		std::list<Function*> res;
-		std::list<Value*> solveRes;
-		solveRes.push_back(origin);
-		while(!solveRes.empty()) {
-			Value *value = solveRes.front();
-			if(Function *theFunc = dyn_cast<Function>(value)) res.push_back(theFunc);
-			// else if(CallInst *callInst = dyn_cast<CallInst>(value)) res.splice(res.end(), solveReturnVal(callInst));
+		void expandValue(unsigned id) {
+			Value *value = nodes[id].value;
+			if(Function *theFunc = dyn_cast<Function>(value)) addFunc(id, theFunc);
 			else if(CallInst *callInst = dyn_cast<CallInst>(value)) {
-				std::list<Function*> tmp;
 				if(Function *doubleCall = callInst->getCalledFunction()) {
-					std::list<Value*> valuesToSolve = getReturnVal(doubleCall);
-					tmp.splice(tmp.end(), solveFunction(callInst, doubleCall, std::move(valuesToSolve), callInst->getParent()));
+					addInput(id, contextNode(callInst, doubleCall, callInst->getParent(), RET));
 				}else if(PHINode *phi = dyn_cast<PHINode>(callInst->getCalledOperand())) {
-					for (BasicBlock *block : phi->blocks()) {
-						std::list<Function*> solveTheVal = solveValue(phi->getIncomingValueForBlock(block));
-						for (Function *func : solveTheVal) {
-							std::list<Value*> valuesToSolve = getReturnVal(func);
-							tmp.splice(tmp.end(), solveFunction(callInst, func, std::move(valuesToSolve), block));
-						}
-					}
-				}else for(Function *func : solveValue(callInst->getCalledOperand())) res.splice(res.end(), solveFunction(callInst, func, std::move(getReturnVal(func)), callInst->getParent()));
-				res.splice(res.end(), tmp);
-			}else if(PHINode *phi = dyn_cast<PHINode>(value)) for(Value *phivalue : phi->incoming_values()) solveRes.push_back(phivalue);
+					for (BasicBlock *block : phi->blocks())
+						addInput(id, valueNode(phi->getIncomingValueForBlock(block)), callInst, block, RET);
+				}else addInput(id, valueNode(callInst->getCalledOperand()), callInst, callInst->getParent(), RET);
+			}else if(PHINode *phi = dyn_cast<PHINode>(value)) for(Value *phivalue : phi->incoming_values()) addInput(id, valueNode(phivalue));
 			else if(Argument *arg = dyn_cast<Argument>(value)) {
-				std::list<Function*> temp;
 				unsigned argIdx = arg->getArgNo();
-				for(User *user : arg->getParent()->users()) {
-					if(CallInst *callInst = dyn_cast<CallInst>(user)) {
-						if(arg->getParent() == callInst->getCalledFunction()) {
-							Value *valueToSolve = callInst->getArgOperand(argIdx);
-							temp.splice(temp.end(), solveValue(valueToSolve));
-						}else {
-							int argNumber = callInst->getNumArgOperands();
-							for(int i = 0; i < argNumber; ++i) {
-								if(arg->getParent() == dyn_cast<Function>(callInst->getArgOperand(i))) {
-									auto calledFunctions = solveValue(callInst->getCalledOperand());
-									for(Function *func : calledFunctions) {
-										std::list<Value*> temp2;
-										for(Function::iterator i = func->begin(); i != func->end(); i++) {
-											for(BasicBlock::iterator j = i->begin(); j != i->end(); j++) {
-												if(CallInst *k = dyn_cast<CallInst>(j)) {
-													if(Argument* calledArg = dyn_cast<Argument>(k->getCalledOperand())) {
-														if(calledArg->getArgNo() == argIdx) temp2.push_back(k->getArgOperand(argIdx));
-													}
-												}
-											}
-										}
-										auto valuesToSolve = temp2;
-										temp.splice(temp.end(), solveFunction(callInst, func, valuesToSolve, callInst->getParent()));
-									}
-								}
-							}
-						}
-					}else errs()<<"for argument user, not a call instruction!\n";
-				}
-				res.splice(res.end(), temp);
-			}else if(ConstantPointerNull *nptr = dyn_cast<ConstantPointerNull>(value)) {}
+				const FuncUses &uses = index.getUses(arg->getParent());
+				for(CallInst *callInst : uses.calls) addInput(id, valueNode(callInst->getArgOperand(argIdx)));
+				// The function is passed to another one: look for calls through that parameter in the callee
+				for(CallInst *callInst : uses.passedTo)
+					addInput(id, valueNode(callInst->getCalledOperand()), callInst, callInst->getParent(), argIdx);
+				for(unsigned i = 0; i < uses.others; i++) diag(id, "for argument user, not a call instruction!\n");
+			}else if(isa<ConstantPointerNull>(value)) {}
 			else if(SelectInst *selectInst = dyn_cast<SelectInst>(value)) {
 				if(CmpInst *cmpInst = dyn_cast<CmpInst>(selectInst->getCondition())) {
 					Value *operand0 = cmpInst->getOperand(0), *operand1 = cmpInst->getOperand(1);
@@ -148,47 +238,197 @@ struct FuncPtrPass : public ModulePass {
 					if((temp = dyn_cast<ConstantInt>(operand0)) && (temp = dyn_cast<ConstantInt>(operand1))) {
 						int64_t item0 = dyn_cast<ConstantInt>(operand0)->getSExtValue();
 						int64_t item1 = dyn_cast<ConstantInt>(operand1)->getSExtValue();
+						Value *chosen = nullptr;
 						switch(cmpInst->getPredicate()) {
-							case CmpInst::ICMP_SGE: if(item0 >= item1) solveRes.push_back(selectInst->getTrueValue()); break;
-							case CmpInst::ICMP_SLT: if(item0 < item1) solveRes.push_back(selectInst->getTrueValue()); break;
-							case CmpInst::ICMP_EQ: if(item0 == item1) solveRes.push_back(selectInst->getTrueValue()); break;
-							case CmpInst::ICMP_NE: if(item0 != item1) solveRes.push_back(selectInst->getTrueValue()); break;
-							case CmpInst::ICMP_SLE: if(item0 <= item1) solveRes.push_back(selectInst->getTrueValue()); break;
-							case CmpInst::ICMP_SGT: if(item0 > item1) solveRes.push_back(selectInst->getTrueValue()); break;
+							case CmpInst::ICMP_SGE: if(item0 >= item1) chosen = selectInst->getTrueValue(); break;
+							case CmpInst::ICMP_SLT: if(item0 < item1) chosen = selectInst->getTrueValue(); break;
+							case CmpInst::ICMP_EQ: if(item0 == item1) chosen = selectInst->getTrueValue(); break;
+							case CmpInst::ICMP_NE: if(item0 != item1) chosen = selectInst->getTrueValue(); break;
+							case CmpInst::ICMP_SLE: if(item0 <= item1) chosen = selectInst->getTrueValue(); break;
+							case CmpInst::ICMP_SGT: if(item0 > item1) chosen = selectInst->getTrueValue(); break;
 							case CmpInst::ICMP_UGT:
 							case CmpInst::ICMP_UGE:
 							case CmpInst::ICMP_ULT:
 							case CmpInst::ICMP_ULE:
-							default: solveRes.push_back(selectInst->getFalseValue()); break;
+							default: chosen = selectInst->getFalseValue(); break;
 						};
+						if(chosen) addInput(id, valueNode(chosen));
 					}else {
-						solveRes.push_back(selectInst->getTrueValue());
-						solveRes.push_back(selectInst->getFalseValue());
+						addInput(id, valueNode(selectInst->getTrueValue()));
+						addInput(id, valueNode(selectInst->getFalseValue()));
+					}
+				}
+			}else diag(id, "ERROR here\n");
+		}
+
+		// Prints the diagnostics of nodes reachable from root, depth-first preorder over inputs; nodes from fired
+		// triggers follow their input, by function id. Nodes in printed were printed with everything they reach and
+		// are skipped, so the order depends only on the module, not on how the calls were split between Solvers
+		void printDiags(unsigned root, std::set<NodeKey> &printed) const {
+			std::vector<unsigned> stack(1, root);
+			while(!stack.empty()) {
+				const Node &node = nodes[stack.back()];
+				stack.pop_back();
+				if(!printed.insert(NodeKey(node.value, node.caller, node.func, node.block, node.tag)).second) continue;
+				for(const char *msg : node.diags) errs() << msg;
+				std::vector<std::tuple<unsigned, unsigned, unsigned>> fired(node.fired);
+				std::sort(fired.begin(), fired.end());
+				std::vector<unsigned> next;
+				for(size_t i = 0, j = 0; i < node.inputs.size(); i++) {
+					next.push_back(node.inputs[i]);
+					for(; j < fired.size() && std::get<0>(fired[j]) == i; j++) next.push_back(std::get<2>(fired[j]));
+				}
+				stack.insert(stack.end(), next.rbegin(), next.rend());
+			}
+		}
+	};
+
+    bool runOnModule(Module &M) override {
+		for(Function &func : M) {
+			funcIds[&func] = funcList.size();
+			funcList.push_back(&func);
+		}
+		indexModule(M);
+		std::vector<std::vector<CallInst*>> indirect; // one group per function with indirect calls
+		for(Module::iterator i = M.begin(); i != M.end(); i++) {
+			std::vector<CallInst*> calls;
+			for(Function::iterator j = i->begin(); j != i->end(); j++) {
+				for(BasicBlock::iterator k = j->begin(); k != j->end(); k++) {
+					if(CallInst *callInst = dyn_cast<CallInst>(k)) {
+						if(Function *func = callInst->getCalledFunction()) {
+							BitVector &funcs = result[callInst];
+							funcs.resize(funcList.size());
+							funcs.set(funcIds[func]);
+						}else if(callInst->getCalledOperand()) calls.push_back(callInst);
+						else errs() << "ERROR\n";
 					}
 				}
-			}else errs()<<"ERROR here\n";
-			solveRes.pop_front();
+			}
+			if(!calls.empty()) indirect.push_back(calls);
 		}
+		std::vector<std::unique_ptr<Solver>> solvers;
+		if(Jobs == 1 || indirect.size() <= 1) solvers.push_back(resolve(indirect, 0, indirect.size()));
+		else solvers = resolveParallel(indirect);
+		// Diagnostics in module order of the indirect calls, the same serially and in parallel
+		std::set<NodeKey> printed;
+		for(std::unique_ptr<Solver> &solver : solvers) {
+			for(auto &root : solver->roots) {
+				result[root.first] = solver->nodes[root.second].funcs;
+				solver->printDiags(root.second, printed);
+			}
+		}
+		// Calls on the same line are merged; functions print by id, i.e. module order
+		std::map<int, BitVector> lines;
+		for(auto &call : result) {
+			BitVector &funcs = lines[call.first->getDebugLoc().getLine()];
+			funcs.resize(funcList.size());
+			funcs |= call.second;
+		}
+		for(std::map<int, BitVector>::iterator i = lines.begin(); i != lines.end(); i++) {
+			if(i->first == 0 || i->second.none()) continue;
+			errs() << i->first << " : ";
+			const char *sep = "";
+			for(unsigned id : i->second.set_bits()) {
+				errs() << sep << funcList[id]->getName();
+				sep = ",";
+			}
+			errs() << '\n';
+		}
+        return false;
+    }
+	// Solves the indirect calls of indirect[begin, end) with one Solver, which keeps the diagnostics
+	std::unique_ptr<Solver> resolve(const std::vector<std::vector<CallInst*>> &indirect, size_t begin, size_t end) const {
+		std::unique_ptr<Solver> solver(new Solver(*this));
+		for(size_t i = begin; i < end; i++)
+			for(CallInst *callInst : indirect[i]) solver->roots.push_back(std::make_pair(callInst, solver->valueNode(callInst->getCalledOperand())));
+		solver->solve();
+		return solver;
+	}
+	// Splits the functions into contiguous chunks for the thread pool, sharing memo tables within a chunk; Solvers are returned in chunk order
+	std::vector<std::unique_ptr<Solver>> resolveParallel(const std::vector<std::vector<CallInst*>> &indirect) const {
+		ThreadPoolStrategy strategy = hardware_concurrency(Jobs);
+		size_t chunks = std::min<size_t>(indirect.size(), strategy.compute_thread_count());
+		std::vector<std::unique_ptr<Solver>> solvers(chunks);
+		ThreadPool pool(strategy);
+		for(size_t c = 0; c < chunks; c++)
+			pool.async([&, c] { solvers[c] = resolve(indirect, indirect.size() * c / chunks, indirect.size() * (c + 1) / chunks); });
+		pool.wait();
+		return solvers;
+	}
+
+	void indexModule(Module &M) {
+		for(Function &func : M) {
+			std::vector<Value*> &rets = returnVals[&func];
+			for(BasicBlock &block : func) {
+				if(ReturnInst *ret = dyn_cast<ReturnInst>(block.getTerminator()))
+					if(ret->getReturnValue()) rets.push_back(ret->getReturnValue());
+				for(Instruction &inst : block)
+					if(CallInst *callInst = dyn_cast<CallInst>(&inst))
+						if(Argument *calledArg = dyn_cast<Argument>(callInst->getCalledOperand())) argCalls[std::make_pair(&func, calledArg->getArgNo())].push_back(callInst);
+			}
+			FuncUses &uses = funcUses[&func];
+			uses.others = 0;
+			for(User *user : func.users()) {
+				if(CallInst *callInst = dyn_cast<CallInst>(user)) {
+					if(callInst->getCalledFunction() == &func) uses.calls.push_back(callInst);
+					else {
+						for(unsigned i = 0; i < callInst->getNumArgOperands(); ++i) {
+							if(callInst->getArgOperand(i) == &func) {
+								uses.passedTo.push_back(callInst);
+								break;
+							}
+						}
+					}
+				}else uses.others++;
+			}
+		}
+	}
+
+	std::list<Value*> getReturnVal(Function *func) const {
+		auto it = returnVals.find(func);
+		if(it == returnVals.end()) return std::list<Value*>();
+		return std::list<Value*>(it->second.begin(), it->second.end());
+	}
+	// Argument argIdx of the calls in func whose callee is parameter argIdx
+	std::list<Value*> getCalledArgVal(Function *func, unsigned argIdx) const {
+		std::list<Value*> res;
+		auto it = argCalls.find(std::make_pair(func, argIdx));
+		if(it == argCalls.end()) return res;
+		for(CallInst *k : it->second) res.push_back(k->getArgOperand(argIdx));
 		return res;
 	}
+	const FuncUses &getUses(Function *func) const { return funcUses.find(func)->second; }
+	unsigned getId(Function *func) const { return funcIds.find(func)->second; }
 };
 char FuncPtrPass::ID = 0;
 static RegisterPass<FuncPtrPass> X("funcptrpass", "Print function call instruction");
 static cl::opt<std::string> InputFilename(cl::Positional, cl::desc("<filename>.bc"), cl::init(""));
+static cl::opt<bool> Lazy("lazy", cl::desc("Load bitcode lazily, keep only function bodies that matter for the analysis and run mem2reg on those alone"), cl::init(false));
 
 int main(int argc, char **argv) {
     LLVMContext &Context = getGlobalContext();
     SMDiagnostic Err;
     cl::ParseCommandLineOptions(argc, argv, "FuncPtrPass \n My first LLVM too which does not do much.\n");
-    std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Context);
+    std::vector<Function*> relevant;
+    std::unique_ptr<Module> M = Lazy ? loadRelevant(InputFilename, Context, Err, relevant) : parseIRFile(InputFilename, Err, Context);
     if (!M) {
         Err.print(argv[0], errs());
         return 1;
     }
     llvm::legacy::PassManager Passes;
-    Passes.add(new EnableFunctionOptPass());
-    Passes.add(llvm::createPromoteMemoryToRegisterPass());
+    if (Lazy) {
+        llvm::legacy::FunctionPassManager FPasses(M.get());
+        FPasses.add(new EnableFunctionOptPass());
+        FPasses.add(llvm::createPromoteMemoryToRegisterPass());
+        FPasses.add(llvm::createCFGSimplificationPass());
+        FPasses.doInitialization();
+        for (Function *F : relevant) FPasses.run(*F);
+        FPasses.doFinalization();
+    } else {
+        Passes.add(new EnableFunctionOptPass());
+        Passes.add(llvm::createPromoteMemoryToRegisterPass());
 	  Passes.add(llvm::createCFGSimplificationPass());
+    }
     Passes.add(new FuncPtrPass());
     Passes.run(*M.get());
 }
\ No newline at end of file
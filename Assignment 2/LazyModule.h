@@ -0,0 +1,125 @@
+#ifndef _LAZYMODULE_H_
+#define _LAZYMODULE_H_
+// Lazy bitcode loading: function bodies are materialized and scanned one at a time, and only
+// the ones that matter to the function pointer analysis are kept for it.
+// Relevant functions are those with indirect calls or taking a function's address, functions
+// whose address is taken, their callers (arguments come from callers), and the functions they
+// call directly that take or return pointers (pointers flow through those), to a fixpoint.
+// Other functions that contain calls keep their bodies so direct calls are still printed,
+// but skip mem2reg. Bodies that are irrelevant and contain no calls are deleted to save memory:
+// functions without calls, function references or pointer arguments/return right after the
+// scan, the rest once every body has been scanned.
+// Input that is not bitcode is parsed whole and every function is relevant.
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/InstrTypes.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SourceMgr.h>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+using namespace llvm;
+
+// Functions referenced from a constant, e.g. a global initializer
+inline void collectFunctions(Constant *c, std::set<Function *> &funcs, std::set<Constant *> &seen) {
+    if(isa<ConstantData>(c) || !seen.insert(c).second) return;
+    if(Function *func = dyn_cast<Function>(c)) {
+        funcs.insert(func);
+        return;
+    }
+    for(Use &op : c->operands())
+        if(Constant *sub = dyn_cast<Constant>(op.get())) collectFunctions(sub, funcs, seen);
+}
+
+inline bool hasPointerInterface(Function *func) {
+    if(func->getReturnType()->isPointerTy()) return true;
+    for(Argument &arg : func->args())
+        if(arg.getType()->isPointerTy()) return true;
+    return false;
+}
+
+// Loads filename and puts the functions to transform to SSA and analyze in relevant.
+// Returns null and fills err on failure.
+inline std::unique_ptr<Module> loadRelevant(StringRef filename, LLVMContext &context, SMDiagnostic &err, std::vector<Function *> &relevant) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getFileOrSTDIN(filename);
+    if(!buffer) {
+        err = SMDiagnostic(filename, SourceMgr::DK_Error, "Could not open input file: " + buffer.getError().message());
+        return nullptr;
+    }
+    if(!isBitcode((const unsigned char *)(*buffer)->getBufferStart(), (const unsigned char *)(*buffer)->getBufferEnd())) {
+        std::unique_ptr<Module> module = parseIR((*buffer)->getMemBufferRef(), err, context);
+        if(module)
+            for(Function &func : *module) relevant.push_back(&func);
+        return module;
+    }
+    Expected<std::unique_ptr<Module>> lazy = getOwningLazyBitcodeModule(std::move(*buffer), context);
+    if(!lazy) {
+        err = SMDiagnostic(filename, SourceMgr::DK_Error, toString(lazy.takeError()));
+        return nullptr;
+    }
+    std::unique_ptr<Module> module = std::move(*lazy);
+
+    std::set<Function *> seeds, addressTaken, hasCall;
+    std::map<Function *, std::set<Function *>> callees, callers;
+    std::set<Constant *> seen;
+    for(GlobalVariable &global : module->globals())
+        if(global.hasInitializer()) collectFunctions(global.getInitializer(), addressTaken, seen);
+    seen.clear();
+    for(Function &func : *module) {
+        if(Error e = func.materialize()) {
+            err = SMDiagnostic(filename, SourceMgr::DK_Error, toString(std::move(e)));
+            return nullptr;
+        }
+        for(BasicBlock &block : func) {
+            for(Instruction &inst : block) {
+                CallBase *call = dyn_cast<CallBase>(&inst);
+                if(call) {
+                    hasCall.insert(&func);
+                    if(Function *callee = call->getCalledFunction()) {
+                        callees[&func].insert(callee);
+                        callers[callee].insert(&func);
+                    }else seeds.insert(&func);
+                }
+                for(Use &op : inst.operands()) {
+                    if(call && call->isCallee(&op)) continue;
+                    if(Constant *c = dyn_cast<Constant>(op.get())) {
+                        std::set<Function *> funcs;
+                        seen.clear();
+                        collectFunctions(c, funcs, seen);
+                        if(funcs.empty()) continue;
+                        seeds.insert(&func);
+                        addressTaken.insert(funcs.begin(), funcs.end());
+                    }
+                }
+            }
+        }
+        if(!hasCall.count(&func) && !seeds.count(&func) && !hasPointerInterface(&func)) func.deleteBody();
+    }
+    seeds.insert(addressTaken.begin(), addressTaken.end());
+
+    std::set<Function *> keep;
+    std::vector<Function *> worklist(seeds.begin(), seeds.end());
+    while(!worklist.empty()) {
+        Function *func = worklist.back();
+        worklist.pop_back();
+        if(!keep.insert(func).second) continue;
+        for(Function *caller : callers[func]) worklist.push_back(caller);
+        for(Function *callee : callees[func])
+            if(hasPointerInterface(callee)) worklist.push_back(callee);
+    }
+    for(Function &func : *module) {
+        if(keep.count(&func)) {
+            if(!func.isDeclaration()) relevant.push_back(&func);
+        }else if(!hasCall.count(&func)) func.deleteBody();
+    }
+    if(Error e = module->materializeAll()) {
+        err = SMDiagnostic(filename, SourceMgr::DK_Error, toString(std::move(e)));
+        return nullptr;
+    }
+    return module;
+}
+#endif /* !_LAZYMODULE_H_ */
@@ -1,10 +1,17 @@
 #ifndef _DATAFLOW_H_
 #define _DATAFLOW_H_
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/PostOrderIterator.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/CFG.h>
 #include <llvm/IR/Function.h>
 #include <llvm/Support/raw_ostream.h>
+#include <algorithm>
+#include <functional>
+#include <list>
 #include <map>
+#include <queue>
+#include <vector>
 using namespace llvm;
 
 template <class T>
@@ -27,6 +34,9 @@ public:
     virtual void compDFVal(Instruction *inst, T *dfval){};
     virtual void compDFVal(Instruction *inst, typename DataflowInsResult<T>::Type *dfval){};
     virtual void merge(T *dest, const T &src) = 0;
+    // Merges the value src carried along the CFG edge from -> to into dest. Override it for
+    // facts that hold on one edge only, such as phi operands; the default is plain merge.
+    virtual void mergeEdge(BasicBlock *from, BasicBlock *to, T *dest, const T &src) { merge(dest, src); }
 };
 Instruction *getFisrtIns(BasicBlock *block) {
     Instruction *ins = &*(block->begin());
@@ -36,55 +46,137 @@ Instruction *getLastIns(BasicBlock *block) {
     Instruction *ins = &*(--(block->end()));
     return ins;
 }
-template <class T>
-void compForwardDataflow(Function *fn, DataflowVisitor<T> *visitor, typename DataflowResult<T>::Type *result, const T &initval) {
-    std::set<BasicBlock *> worklist;
-    for(Function::iterator i=fn->begin(); i!=fn->end(); i++) {
-        worklist.insert(&*i);
-        result->insert(std::make_pair(&*i, std::make_pair(initval, initval)));
+// Worklist that hands out basic blocks by a fixed priority: reverse post-order for forward
+// problems and post-order for backward ones, so a block's predecessors (successors when
+// backward) are usually done first. Unreachable blocks come last.
+// A block is in the list at most once; visits counts the blocks taken out.
+class BlockWorklist {
+    std::vector<BasicBlock *> blocks; // priority -> block
+    DenseMap<BasicBlock *, unsigned> priority;
+    std::vector<bool> queued;
+    std::priority_queue<unsigned, std::vector<unsigned>, std::greater<unsigned> > queue;
+public:
+    unsigned visits;
+    BlockWorklist(Function *fn, bool isforward) : visits(0) {
+        if(fn->empty()) return;
+        ReversePostOrderTraversal<Function *> rpo(fn);
+        blocks.assign(rpo.begin(), rpo.end());
+        if(!isforward) std::reverse(blocks.begin(), blocks.end());
+        for(unsigned i = 0; i < blocks.size(); i++) priority[blocks[i]] = i;
+        for(Function::iterator i = fn->begin(); i != fn->end(); i++)
+            if(priority.insert(std::make_pair(&*i, blocks.size())).second) blocks.push_back(&*i);
+        queued.assign(blocks.size(), false);
+        for(unsigned i = 0; i < blocks.size(); i++) push(blocks[i]);
+    }
+    bool empty() const { return queue.empty(); }
+    void push(BasicBlock *block) {
+        unsigned p = priority[block];
+        if(queued[p]) return;
+        queued[p] = true;
+        queue.push(p);
     }
+    BasicBlock *pop() {
+        unsigned p = queue.top();
+        queue.pop();
+        queued[p] = false;
+        visits++;
+        return blocks[p];
+    }
+};
+// Returns the number of blocks processed
+template <class T>
+unsigned compForwardDataflow(Function *fn, DataflowVisitor<T> *visitor, typename DataflowResult<T>::Type *result, const T &initval) {
+    for(Function::iterator i=fn->begin(); i!=fn->end(); i++) result->insert(std::make_pair(&*i, std::make_pair(initval, initval)));
+    BlockWorklist worklist(fn, true);
     while (!worklist.empty()) {
-        BasicBlock *block = *worklist.begin();
-        worklist.erase(worklist.begin());
+        BasicBlock *block = worklist.pop();
         T bbinval = (*result)[block].first;
         if (block == &fn->getEntryBlock()) visitor->mergeInput(fn, block, &bbinval);
         else {
             bbinval.ps_field.clear();
             bbinval.ps.clear();
-            for(auto i=pred_begin(block); i!=pred_end(block); i++) visitor->merge(&bbinval, (*result)[*i].second);
+            for(auto i=pred_begin(block); i!=pred_end(block); i++) visitor->mergeEdge(*i, block, &bbinval, (*result)[*i].second);
         }
-        T old_bbexitval = (*result)[block].second;
         (*result)[block].first = bbinval;
         visitor->compDFVal(block, &bbinval, true);
         if (bbinval == (*result)[block].second) continue;
         (*result)[block].second = bbinval;
-        for(succ_iterator i=succ_begin(block); i!=succ_end(block); i++) worklist.insert(*i);
+        for(succ_iterator i=succ_begin(block); i!=succ_end(block); i++) worklist.push(*i);
     }
-    return;
+    return worklist.visits;
 }
 template <class T>
-void compBackwardDataflow(Function *fn, DataflowVisitor<T> *visitor, typename DataflowResult<T>::Type *result, const T &initval) {
-    std::set<BasicBlock *> worklist;
-    for(Function::iterator bi = fn->begin(); bi != fn->end(); ++bi) {
-        BasicBlock *bb = &*bi;
-        result->insert(std::make_pair(bb, std::make_pair(initval, initval)));
-        worklist.insert(bb);
-    }
+unsigned compBackwardDataflow(Function *fn, DataflowVisitor<T> *visitor, typename DataflowResult<T>::Type *result, const T &initval) {
+    for(Function::iterator bi = fn->begin(); bi != fn->end(); ++bi) result->insert(std::make_pair(&*bi, std::make_pair(initval, initval)));
+    BlockWorklist worklist(fn, false);
     while (!worklist.empty()) {
-        BasicBlock *bb = *worklist.begin();
-        worklist.erase(worklist.begin());
+        BasicBlock *bb = worklist.pop();
         T bbexitval = (*result)[bb].second;
         for(auto si = succ_begin(bb), se = succ_end(bb); si != se; si++) {
             BasicBlock *succ = *si;
-            visitor->merge(&bbexitval, (*result)[succ].first);
+            visitor->mergeEdge(bb, succ, &bbexitval, (*result)[succ].first);
         }
         (*result)[bb].second = bbexitval;
         visitor->compDFVal(bb, &bbexitval, false);
         if (bbexitval == (*result)[bb].first) continue;
         (*result)[bb].first = bbexitval;
-        for(pred_iterator i=pred_begin(bb); i!=pred_end(bb); i++) worklist.insert(*i);
+        for(pred_iterator i=pred_begin(bb); i!=pred_end(bb); i++) worklist.push(*i);
     }
+    return worklist.visits;
 }
+// Dataflow values before and after an instruction, computed on demand instead of stored
+// per instruction: the transfer function is replayed from the solved block entry value
+// (exit value for backward problems) up to the instruction asked for. The last capacity
+// blocks replayed are cached whole, least recently used first out. A returned reference
+// stays valid until the next query.
+// Replaying calls the visitor's compDFVal again, so its side effects beyond dfval repeat.
+template <class T>
+class InstructionFacts {
+    typedef typename DataflowInsResult<T>::Type Facts;
+    DataflowVisitor<T> *visitor;
+    const typename DataflowResult<T>::Type *result;
+    bool isforward;
+    size_t capacity;
+    std::list<BasicBlock *> recent; // most recently used first
+    std::map<BasicBlock *, std::pair<typename std::list<BasicBlock *>::iterator, Facts> > cache;
+
+    const Facts &replay(BasicBlock *block) {
+        auto it = cache.find(block);
+        if(it != cache.end()) {
+            recent.splice(recent.begin(), recent, it->second.first);
+            return it->second.second;
+        }
+        if(cache.size() >= capacity) {
+            cache.erase(recent.back());
+            recent.pop_back();
+        }
+        recent.push_front(block);
+        std::pair<typename std::list<BasicBlock *>::iterator, Facts> &entry = cache[block];
+        entry.first = recent.begin();
+        Facts &facts = entry.second;
+        if(isforward) {
+            T dfval = result->find(block)->second.first;
+            for(BasicBlock::iterator i = block->begin(); i != block->end(); i++) {
+                T before = dfval;
+                visitor->compDFVal(&*i, &dfval);
+                facts.insert(std::make_pair(&*i, std::make_pair(before, dfval)));
+            }
+        } else {
+            T dfval = result->find(block)->second.second;
+            for(BasicBlock::reverse_iterator i = block->rbegin(); i != block->rend(); i++) {
+                T after = dfval;
+                visitor->compDFVal(&*i, &dfval);
+                facts.insert(std::make_pair(&*i, std::make_pair(dfval, after)));
+            }
+        }
+        return facts;
+    }
+public:
+    InstructionFacts(DataflowVisitor<T> *visitor, const typename DataflowResult<T>::Type *result, bool isforward, size_t capacity = 16)
+        : visitor(visitor), result(result), isforward(isforward), capacity(capacity ? capacity : 1) {}
+    const T &before(Instruction *inst) { return replay(inst->getParent()).find(inst)->second.first; }
+    const T &after(Instruction *inst) { return replay(inst->getParent()).find(inst)->second.second; }
+};
 template <class T>
 void printDataflowResult(raw_ostream &out, const typename DataflowResult<T>::Type &dfresult) {
     for(typename DataflowResult<T>::Type::const_iterator i=dfresult.begin(); i!=dfresult.end(); i++) {
@@ -93,4 +185,21 @@ void printDataflowResult(raw_ostream &out, const typename DataflowResult<T>::Typ
         out<<"\n\tin : "<<i->second.first<<"\n\tout :  "<<i->second.second<<"\n";
     }
 }
+// Prints the values before and after every instruction of fn as replayed by facts. A block
+// whose replay does not end at its solved entry and exit values is reported as a mismatch.
+template <class T>
+void printInstructionFacts(raw_ostream &out, Function *fn, InstructionFacts<T> &facts, const typename DataflowResult<T>::Type &dfresult) {
+    for(Function::iterator bi = fn->begin(); bi != fn->end(); bi++) {
+        BasicBlock *block = &*bi;
+        if(block->empty()) continue;
+        for(BasicBlock::iterator i = block->begin(); i != block->end(); i++) {
+            i->dump();
+            out<<"\tin : "<<facts.before(&*i)<<"\n\tout :  "<<facts.after(&*i)<<"\n";
+        }
+        const std::pair<T, T> &solved = dfresult.find(block)->second;
+        bool same = facts.before(&block->front()) == solved.first;
+        same = same && facts.after(&block->back()) == solved.second;
+        if(!same) out<<"mismatch: replay of "<<block->getName()<<" does not match its block result\n";
+    }
+}
 #endif /* !_DATAFLOW_H_ */
\ No newline at end of file
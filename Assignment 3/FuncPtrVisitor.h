@@ -5,8 +5,10 @@
 #include <iostream>
 #include <list>
 #include "Dataflow.h"
+#include "PersistentSet.h"
 using namespace llvm;
-typedef std::map<Value*, std::set<Value*>> Pointer2Set;
+// Points-to sets are hash-consed persistent structures: O(1) copies, pointer equality
+typedef PtsMap Pointer2Set;
 
 struct PointerInfo {
     Pointer2Set ps;
@@ -18,10 +20,10 @@ struct PointerInfo {
 
 inline raw_ostream& operator<<(raw_ostream& out, const Pointer2Set& ps) {
     out<<"{ ";
-    for(auto i=ps.begin(); i!=ps.end(); i++) {
-        out<<i->first->getName()<<". "<<i->first<<" -> "<<"( ";
-        for(auto j = i->second.begin(); j != i->second.end(); j++) {
-            if(j != i->second.begin()) errs()<<", ";
+    for(auto i : ps) {
+        out<<i.first->getName()<<". "<<i.first<<" -> "<<"( ";
+        for(auto j = i.second.begin(); j != i.second.end(); ++j) {
+            if(j != i.second.begin()) errs()<<", ";
             out<<(*j)->getName()<<". "<<(*j);
         }
         out<<" ) | ";
@@ -40,31 +42,22 @@ public:
     std::map<Function*, PointerInfo> arg_p2s;
     std::map<Function*, PointerInfo> ret_arg_p2s;
     std::map<Function*, std::set<Function*>> caller_map;
-    std::map<Function*, std::set<Value*>> ret_p2s;
+    std::map<Function*, PtsSet> ret_p2s;
     std::map<int, std::list<Function*>> result;
     std::set<Function*> worklist;
     bool change = false;
     FuncPtrVisitor() : result(), arg_p2s(), ret_p2s(), ret_arg_p2s(), caller_map() {}
     void merge(PointerInfo* dest, const PointerInfo& src) override {
-        for(Pointer2Set::const_iterator i=src.ps.begin(); i!=src.ps.end(); i++)
-            for(std::set<Value*>::iterator j=i->second.begin(); j!=i->second.end(); j++) dest->ps[i->first].insert(*j);
-        for(Pointer2Set::const_iterator i=src.ps_field.begin(); i!=src.ps_field.end(); i++)
-            for(std::set<Value*>::iterator j = i->second.begin(); j != i->second.end(); j++) dest->ps_field[i->first].insert(*j);
+        dest->ps.merge(src.ps);
+        dest->ps_field.merge(src.ps_field);
     }
 
     void mergeInput(Function* fn, BasicBlock* bb, PointerInfo* bbinval) {
-        PointerInfo pi = arg_p2s[fn];;
-        for(auto i : pi.ps) {
-            bbinval->ps[i.first].clear();
-            bbinval->ps[i.first].insert(i.second.begin(), i.second.end());
-        }
-        for(auto i : pi.ps_field) {
-            bbinval->ps_field[i.first].clear();
-            bbinval->ps_field[i.first].insert(i.second.begin(), i.second.end());
-        }
+        PointerInfo pi = arg_p2s[fn];
+        for(auto i : pi.ps) bbinval->ps.set(i.first, i.second);
+        for(auto i : pi.ps_field) bbinval->ps_field.set(i.first, i.second);
     }
     void handleCallInst(CallInst* callInst, PointerInfo* dfval) {
-        std::map<Function*, PointerInfo> old_arg_p2s = arg_p2s;
         int line = callInst->getDebugLoc().getLine();
         result[line].clear();
         std::set<Function*> callees = getFuncByValue_work(callInst->getCalledOperand(), dfval);
@@ -79,10 +72,12 @@ public:
             Value* arg = callInst->getArgOperand(i);
             if(arg->getType()->isPointerTy()) {
                 if(Function* func = dyn_cast<Function>(arg)) {
-                    caller_args.ps[arg].insert(func);
+                    PtsSet funcs;
+                    funcs.insert(func);
+                    caller_args.ps.insert(arg, funcs);
                 } else {
-                    caller_args.ps[arg].insert(dfval->ps[arg].begin(), dfval->ps[arg].end());
-                    caller_args.ps_field[arg].insert(dfval->ps_field[arg].begin(), dfval->ps_field[arg].end());
+                    caller_args.ps.insert(arg, dfval->ps.get(arg));
+                    caller_args.ps_field.insert(arg, dfval->ps_field.get(arg));
                 }
             }
         }
@@ -103,27 +98,35 @@ public:
                 }
             }
         }
+        // Only the callees' arg_p2s can change; remember their old values (if any) to detect a change
+        std::map<Function*, PointerInfo> old_arg_p2s;
+        for(auto i = callees.begin(); i != callees.end(); i++) {
+            auto old = arg_p2s.find(*i);
+            if(old != arg_p2s.end()) old_arg_p2s.insert(*old);
+        }
         for(auto i = callees.begin(); i != callees.end(); i++) {
             Function* callee = *i;
+            PointerInfo& callee_p2s = arg_p2s[callee];
             for(unsigned j = 0; j < callInst->getNumArgOperands(); j++) {
                 Value* caller_arg = callInst->getArgOperand(j);
                 if(caller_arg->getType()->isPointerTy()) {
                     Value* callee_arg = callee->arg_begin() + j;
-                    arg_p2s[callee].ps[callee_arg].insert(caller_args.ps[caller_arg].begin(), caller_args.ps[caller_arg].end());
-                    arg_p2s[callee].ps_field[callee_arg].insert(caller_args.ps_field[caller_arg].begin(), caller_args.ps_field[caller_arg].end());
+                    callee_p2s.ps.insert(callee_arg, caller_args.ps.get(caller_arg));
+                    callee_p2s.ps_field.insert(callee_arg, caller_args.ps_field.get(caller_arg));
                     std::set<Value*> wl;
-                    for(auto* k : caller_args.ps[caller_arg]) wl.insert(&*k);
-                    for(auto* k : caller_args.ps_field[caller_arg]) wl.insert(&*k);
+                    for(Value* k : caller_args.ps.get(caller_arg)) wl.insert(k);
+                    for(Value* k : caller_args.ps_field.get(caller_arg)) wl.insert(k);
                     std::set<Value*> oldlist;
                     while (!wl.empty()) {
                         Value* v = *wl.begin();
                         wl.erase(wl.begin());
                         if(oldlist.count(v)) continue;
                         oldlist.insert(v);
-                        arg_p2s[callee].ps[v].insert(dfval->ps[v].begin(), dfval->ps[v].end());
-                        wl.insert(dfval->ps[v].begin(), dfval->ps[v].end());
-                        arg_p2s[callee].ps_field[v].insert(dfval->ps_field[v].begin(), dfval->ps_field[v].end());
-                        wl.insert(dfval->ps_field[v].begin(), dfval->ps_field[v].end());
+                        PtsSet pointees = dfval->ps.get(v), fields = dfval->ps_field.get(v);
+                        callee_p2s.ps.insert(v, pointees);
+                        wl.insert(pointees.begin(), pointees.end());
+                        callee_p2s.ps_field.insert(v, fields);
+                        wl.insert(fields.begin(), fields.end());
                     }
                 }
             }
@@ -133,24 +136,26 @@ public:
             for(auto j : ret_arg_p2s[callee].ps) {
                 Value* t = j.first;
                 if(ce_arg_set.count(t) > 0) t = argmap[callee][t];
-                dfval->ps[t].clear();
-                for(auto k : j.second) {
-                    if(ce_arg_set.count(&*k) > 0) dfval->ps[t].insert(argmap[callee][&*k]);
-                    else dfval->ps[t].insert(&*k);
-                }
+                PtsSet values;
+                for(Value* k : j.second) values.insert(ce_arg_set.count(k) > 0 ? argmap[callee][k] : k);
+                dfval->ps.set(t, values);
             }
             for(auto j : ret_arg_p2s[callee].ps_field) {
                 Value* t = j.first;
                 if(ce_arg_set.count(t) > 0) t = argmap[callee][t];
-                dfval->ps_field[t].clear();
-                for(auto k : j.second) {
-                    if(ce_arg_set.count(&*k) > 0) dfval->ps_field[t].insert(argmap[callee][&*k]);
-                    else dfval->ps_field[t].insert(&*k);
-                }
+                PtsSet values;
+                for(Value* k : j.second) values.insert(ce_arg_set.count(k) > 0 ? argmap[callee][k] : k);
+                dfval->ps_field.set(t, values);
             }
         }
-        for(auto i = callees.begin(); i != callees.end(); i++) if(!ret_p2s[*i].empty()) dfval->ps[callInst].insert(ret_p2s[*i].begin(), ret_p2s[*i].end());
-        if(old_arg_p2s != arg_p2s) for(auto i = callees.begin(); i!=callees.end(); i++) worklist.insert(*i);
+        for(auto i = callees.begin(); i != callees.end(); i++) if(!ret_p2s[*i].empty()) dfval->ps.insert(callInst, ret_p2s[*i]);
+        bool changed = false;
+        for(auto i = callees.begin(); i != callees.end() && !changed; i++) {
+            auto cur = arg_p2s.find(*i), old = old_arg_p2s.find(*i);
+            if(cur == arg_p2s.end()) changed = old != old_arg_p2s.end();
+            else changed = old == old_arg_p2s.end() || !(cur->second == old->second);
+        }
+        if(changed) for(auto i = callees.begin(); i!=callees.end(); i++) worklist.insert(*i);
     }
     void compDFVal(Instruction* inst, PointerInfo* dfval) override {
         if(isa<DbgInfoIntrinsic>(inst)) return;
@@ -160,10 +165,8 @@ public:
                 Value* dst = dyn_cast<BitCastInst>(memCpyInst->getArgOperand(0))->getOperand(0);
                 if(!dyn_cast<BitCastInst>(memCpyInst->getArgOperand(1))) return;
                 Value* src = dyn_cast<BitCastInst>(memCpyInst->getArgOperand(1))->getOperand(0);
-                dfval->ps[dst].clear();
-                dfval->ps[dst].insert(dfval->ps[src].begin(), dfval->ps[src].end());
-                dfval->ps_field[dst].clear();
-                dfval->ps_field[dst].insert(dfval->ps_field[src].begin(), dfval->ps_field[src].end());
+                dfval->ps.set(dst, dfval->ps.get(src));
+                dfval->ps_field.set(dst, dfval->ps_field.get(src));
             }
             return;
         }
@@ -171,19 +174,13 @@ public:
             Function* func = returnInst->getFunction();
             Value* retValue = returnInst->getReturnValue();
             auto temp1 = ret_arg_p2s[func];
-            for(auto i : arg_p2s[func].ps) {
-                ret_arg_p2s[func].ps[i.first].clear();
-                ret_arg_p2s[func].ps[i.first].insert(dfval->ps[i.first].begin(), dfval->ps[i.first].end());
-            }
-            for(auto i : arg_p2s[func].ps_field) {
-                ret_arg_p2s[func].ps_field[i.first].clear();
-                ret_arg_p2s[func].ps_field[i.first].insert(dfval->ps_field[i.first].begin(), dfval->ps_field[i.first].end());
-            }
+            for(auto i : arg_p2s[func].ps) ret_arg_p2s[func].ps.set(i.first, dfval->ps.get(i.first));
+            for(auto i : arg_p2s[func].ps_field) ret_arg_p2s[func].ps_field.set(i.first, dfval->ps_field.get(i.first));
             bool flag = false;
             if(!(ret_arg_p2s[func] == temp1)) flag = true;
             if(retValue && retValue->getType()->isPointerTy()) {
                 auto temp2 = ret_p2s[func];
-                ret_p2s[func].insert(dfval->ps[retValue].begin(), dfval->ps[retValue].end());
+                ret_p2s[func].insert(dfval->ps.get(retValue));
                 if(ret_p2s[func] != temp2) flag = true;
             }
             if(flag) {
@@ -194,50 +191,39 @@ public:
             }
         } else if(LoadInst* loadInst = dyn_cast<LoadInst>(inst)) {
             Value* target_value = loadInst->getPointerOperand();
-            dfval->ps[loadInst].clear();
-            std::set<Value*> values;
+            PtsSet values;
             if(GetElementPtrInst* gepInst = dyn_cast<GetElementPtrInst>(target_value)) {
                 Value* ptr = gepInst->getPointerOperand();
-                values = dfval->ps[ptr];
-                if(dfval->ps[ptr].empty()) {
-                    values = dfval->ps_field[ptr];
-                    dfval->ps[loadInst].insert(values.begin(), values.end());
-                } else for(auto i=dfval->ps[ptr].begin(); i!=dfval->ps[ptr].end(); i++) dfval->ps[loadInst].insert(dfval->ps_field[*i].begin(), dfval->ps_field[*i].end());
-            } else dfval->ps[loadInst].insert(dfval->ps[target_value].begin(), dfval->ps[target_value].end());
+                PtsSet pointees = dfval->ps.get(ptr);
+                if(pointees.empty()) values = dfval->ps_field.get(ptr);
+                else for(Value* i : pointees) values.insert(dfval->ps_field.get(i));
+            } else values = dfval->ps.get(target_value);
+            dfval->ps.set(loadInst, values);
         } else if(PHINode* phyNode = dyn_cast<PHINode>(inst)) {
-            dfval->ps[phyNode].clear();
+            // A node as its own incoming value only merges what was already collected; skip it
+            PtsSet values;
             for(Value* v : phyNode->incoming_values()) {
                 if(Function* func = dyn_cast<Function>(v)) {
-                    dfval->ps[phyNode].insert(func);
-                } else if(v->getType()->isPointerTy()) dfval->ps[phyNode].insert(dfval->ps[v].begin(), dfval->ps[v].end());
+                    values.insert(func);
+                } else if(v != phyNode && v->getType()->isPointerTy()) values.insert(dfval->ps.get(v));
             }
+            dfval->ps.set(phyNode, values);
         } else if(StoreInst* storeInst = dyn_cast<StoreInst>(inst)) {
             Value* store_value = storeInst->getValueOperand();
             Value* target_value = storeInst->getPointerOperand();
-            std::set<Value*> store_values;
-            if(dfval->ps[store_value].empty()) store_values.insert(store_value);
-            else store_values.insert(dfval->ps[store_value].begin(), dfval->ps[store_value].end());
+            PtsSet store_values = dfval->ps.get(store_value);
+            if(store_values.empty()) store_values.insert(store_value);
             if(GetElementPtrInst* gepInst = dyn_cast<GetElementPtrInst>(target_value)) {
                 Value* ptr = gepInst->getPointerOperand();
-                if(dfval->ps[ptr].empty()) {
-                    dfval->ps_field[ptr].clear();
-                    dfval->ps_field[ptr].insert(store_values.begin(), store_values.end());
-                } else {
-                    std::set<Value*> values = dfval->ps[ptr];
-                    for(auto i=values.begin(); i!=values.end(); i++) {
-                        dfval->ps_field[*i].clear();
-                        dfval->ps_field[*i].insert(store_values.begin(), store_values.end());
-                    }
-                }
-            } else{
-                dfval->ps[target_value].clear();
-                dfval->ps[target_value].insert(store_values.begin(), store_values.end());
-            }
+                PtsSet values = dfval->ps.get(ptr);
+                if(values.empty()) dfval->ps_field.set(ptr, store_values);
+                else for(Value* i : values) dfval->ps_field.set(i, store_values);
+            } else dfval->ps.set(target_value, store_values);
         } else if(GetElementPtrInst* getElementPtrInst = dyn_cast<GetElementPtrInst>(inst)) {
             Value* ptr = getElementPtrInst->getPointerOperand();
-            dfval->ps[getElementPtrInst].clear();
-            if(dfval->ps[ptr].empty()) dfval->ps[getElementPtrInst].insert(ptr);
-            else dfval->ps[getElementPtrInst].insert(dfval->ps[ptr].begin(), dfval->ps[ptr].end());
+            PtsSet values = dfval->ps.get(ptr);
+            if(values.empty()) values.insert(ptr);
+            dfval->ps.set(getElementPtrInst, values);
         } else if(CallInst* callInst = dyn_cast<CallInst>(inst)) handleCallInst(callInst, dfval);
     }
 
@@ -247,8 +233,8 @@ public:
             res.insert(i);
             return res;
         }
-        for(auto i = dfval->ps[value].begin(); i!=dfval->ps[value].end(); i++) {
-            std::set<Function*> r = getFuncByValue_work(*i, dfval);
+        for(Value* i : dfval->ps.get(value)) {
+            std::set<Function*> r = getFuncByValue_work(i, dfval);
             res.insert(r.begin(), r.end());
         }
         return res;
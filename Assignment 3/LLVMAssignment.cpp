@@ -27,6 +27,7 @@
 #include <llvm/Transforms/Utils.h>
 
 #include "FuncPtrVisitor.h"
+#include "LazyModule.h"
 #include "Liveness.h"
 using namespace llvm;
 static ManagedStatic<LLVMContext> GlobalContext;
@@ -79,6 +80,10 @@ char Liveness::ID = 0;
 static RegisterPass<Liveness> Y("liveness", "Liveness Dataflow Analysis");
 
 static cl::opt<std::string> InputFilename(cl::Positional, cl::desc("<filename>.bc"), cl::init(""));
+static cl::opt<bool> RunLiveness("liveness", cl::desc("Print the live values at every block instead of resolving function pointers"), cl::init(false));
+static cl::opt<bool> SparseLiveness("ssa-liveness", cl::desc("Like -liveness, but answer each block from the per-value SSA liveness queries"), cl::init(false));
+static cl::opt<bool> LivenessFacts("liveness-facts", cl::desc("Like -liveness, and also print the live values before and after every instruction"), cl::init(false));
+static cl::opt<bool> Lazy("lazy", cl::desc("Load bitcode lazily, keep only function bodies that matter for the analysis and run mem2reg on those alone"), cl::init(false));
 
 int main(int argc, char **argv) {
     LLVMContext &Context = getGlobalContext();
@@ -89,21 +94,36 @@ int main(int argc, char **argv) {
         "FuncPtrPass \n My first LLVM too which does not do much.\n");
 
     // Load the input module
-    std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Context);
+    std::vector<Function *> relevant;
+    std::unique_ptr<Module> M = Lazy ? loadRelevant(InputFilename, Context, Err, relevant) : parseIRFile(InputFilename, Err, Context);
     if (!M) {
         Err.print(argv[0], errs());
         return 1;
     }
 
     llvm::legacy::PassManager Passes;
+    if (Lazy) {
+        /// Transform only the relevant functions to SSA
+        llvm::legacy::FunctionPassManager FPasses(M.get());
 #if LLVM_VERSION_MAJOR >= 5
-    Passes.add(new EnableFunctionOptPass());
+        FPasses.add(new EnableFunctionOptPass());
 #endif
-    /// Transform it to SSA
-    Passes.add(llvm::createPromoteMemoryToRegisterPass());
+        FPasses.add(llvm::createPromoteMemoryToRegisterPass());
+        FPasses.doInitialization();
+        for (Function *F : relevant) FPasses.run(*F);
+        FPasses.doFinalization();
+    } else {
+#if LLVM_VERSION_MAJOR >= 5
+        Passes.add(new EnableFunctionOptPass());
+#endif
+        /// Transform it to SSA
+        Passes.add(llvm::createPromoteMemoryToRegisterPass());
+    }
 
     /// Your pass to print Function and Call Instructions
-    // Passes.add(new Liveness());
-    Passes.add(new FuncPtrPass());
+    if (RunLiveness || SparseLiveness || LivenessFacts)
+        Passes.add(new Liveness(SparseLiveness, LivenessFacts));
+    else
+        Passes.add(new FuncPtrPass());
     Passes.run(*M.get());
 }
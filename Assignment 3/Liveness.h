@@ -12,18 +12,44 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/IntrinsicInst.h>
 #include <llvm/Pass.h>
 #include <llvm/Support/raw_ostream.h>
+#include <memory>
+#include <vector>
 
 #include "Dataflow.h"
 using namespace llvm;
 
+/// Dense numbering of the values a function defines: every non-void
+/// instruction gets an index, and live sets are bit vectors over it.
+struct LivenessNumbering {
+    std::vector<Instruction *> Insts;
+    DenseMap<Instruction *, unsigned> Ids;
+    explicit LivenessNumbering(Function &F) {
+        for (BasicBlock &BB : F)
+            for (Instruction &I : BB)
+                if (!I.getType()->isVoidTy()) {
+                    Ids[&I] = Insts.size();
+                    Insts.push_back(&I);
+                }
+    }
+    unsigned size() const { return Insts.size(); }
+};
+
 struct LivenessInfo {
-    std::set<Instruction *> LiveVars;  /// Set of variables which are live
-    LivenessInfo() : LiveVars() {}
-    LivenessInfo(const LivenessInfo &info) : LiveVars(info.LiveVars) {}
+    BitVector LiveVars;  /// Set of variables which are live
+    const LivenessNumbering *Numbering;
+    LivenessInfo() : LiveVars(), Numbering(nullptr) {}
+    explicit LivenessInfo(const LivenessNumbering &N)
+        : LiveVars(N.size()), Numbering(&N) {}
+    LivenessInfo(const LivenessInfo &info)
+        : LiveVars(info.LiveVars), Numbering(info.Numbering) {}
 
     bool operator==(const LivenessInfo &info) const {
         return LiveVars == info.LiveVars;
@@ -31,52 +57,203 @@ struct LivenessInfo {
 };
 
 inline raw_ostream &operator<<(raw_ostream &out, const LivenessInfo &info) {
-    for (std::set<Instruction *>::iterator ii = info.LiveVars.begin(),
-                                           ie = info.LiveVars.end();
-         ii != ie; ++ii) {
-        const Instruction *inst = *ii;
+    for (unsigned id : info.LiveVars.set_bits()) {
+        const Instruction *inst = info.Numbering->Insts[id];
         out << inst->getName();
         out << " ";
     }
     return out;
 }
 
+/// Backward liveness over the dense numbering. Each block's transfer is
+/// summarised up front as in = gen | (out & ~kill): gen holds the values used
+/// in the block before any definition there, kill the values it defines.
+/// Meet is a word-wise OR. A phi operand is not used in the phi's block but at
+/// the end of the matching predecessor, so it is added on that edge alone and
+/// is live out of that predecessor only, as in SSALiveness.
 class LivenessVisitor : public DataflowVisitor<struct LivenessInfo> {
+    const LivenessNumbering &Numbering;
+    DenseMap<BasicBlock *, std::pair<BitVector, BitVector> > GenKill;
+    DenseMap<std::pair<BasicBlock *, BasicBlock *>, BitVector> PhiUses;
+
    public:
-    LivenessVisitor() {}
+    LivenessVisitor(Function &F, const LivenessNumbering &N)
+        : Numbering(N) {
+        for (BasicBlock &BB : F) {
+            BitVector gen(N.size()), kill(N.size());
+            for (BasicBlock::reverse_iterator ii = BB.rbegin(), ie = BB.rend();
+                 ii != ie; ++ii) {
+                Instruction *inst = &*ii;
+                if (isa<DbgInfoIntrinsic>(inst)) continue;
+                if (!inst->getType()->isVoidTy()) {
+                    unsigned id = N.Ids.lookup(inst);
+                    gen.reset(id);
+                    kill.set(id);
+                }
+                if (PHINode *phi = dyn_cast<PHINode>(inst)) {
+                    for (unsigned i = 0, e = phi->getNumIncomingValues(); i != e;
+                         ++i)
+                        if (Instruction *op =
+                                dyn_cast<Instruction>(phi->getIncomingValue(i))) {
+                            BitVector &uses = PhiUses[std::make_pair(
+                                phi->getIncomingBlock(i), &BB)];
+                            if (uses.empty()) uses.resize(N.size());
+                            uses.set(N.Ids.lookup(op));
+                        }
+                    continue;
+                }
+                for (Value *val : inst->operands())
+                    if (Instruction *op = dyn_cast<Instruction>(val))
+                        gen.set(N.Ids.lookup(op));
+            }
+            GenKill[&BB] = std::make_pair(gen, kill);
+        }
+    }
     void merge(LivenessInfo *dest, const LivenessInfo &src) override {
-        for (std::set<Instruction *>::const_iterator ii = src.LiveVars.begin(),
-                                                     ie = src.LiveVars.end();
-             ii != ie; ++ii) {
-            dest->LiveVars.insert(*ii);
+        dest->LiveVars |= src.LiveVars;
+    }
+    void mergeEdge(BasicBlock *from, BasicBlock *to, LivenessInfo *dest,
+                   const LivenessInfo &src) override {
+        dest->LiveVars |= src.LiveVars;
+        auto it = PhiUses.find(std::make_pair(from, to));
+        if (it != PhiUses.end()) dest->LiveVars |= it->second;
+    }
+
+    void compDFVal(BasicBlock *block, LivenessInfo *dfval,
+                   bool isforward) override {
+        if (isforward) {
+            DataflowVisitor<LivenessInfo>::compDFVal(block, dfval, isforward);
+            return;
         }
+        const std::pair<BitVector, BitVector> &masks = GenKill[block];
+        dfval->LiveVars.reset(masks.second);
+        dfval->LiveVars |= masks.first;
     }
+    using DataflowVisitor<LivenessInfo>::compDFVal;
 
     void compDFVal(Instruction *inst, LivenessInfo *dfval) override {
         if (isa<DbgInfoIntrinsic>(inst)) return;
-        dfval->LiveVars.erase(inst);
+        if (!inst->getType()->isVoidTy())
+            dfval->LiveVars.reset(Numbering.Ids.lookup(inst));
+        if (isa<PHINode>(inst)) return;
         for (User::op_iterator oi = inst->op_begin(), oe = inst->op_end();
              oi != oe; ++oi) {
             Value *val = *oi;
             if (isa<Instruction>(val))
-                dfval->LiveVars.insert(cast<Instruction>(val));
+                dfval->LiveVars.set(Numbering.Ids.lookup(cast<Instruction>(val)));
+        }
+    }
+};
+
+/// Liveness of SSA values without per-block lattice values. A value's live-in
+/// and live-out blocks are found by walking backward from each of its uses to
+/// its definition, the first time the value is queried, and only for that
+/// value. A phi operand is used at the end of the matching predecessor.
+class SSALiveness {
+    struct Blocks {
+        SmallPtrSet<BasicBlock *, 8> In, Out;
+    };
+    DenseMap<Instruction *, std::unique_ptr<Blocks> > Cache;
+
+    static void markLiveIn(BasicBlock *bb, BasicBlock *def, Blocks &blocks,
+                           std::vector<BasicBlock *> &worklist) {
+        if (bb != def && blocks.In.insert(bb).second) worklist.push_back(bb);
+    }
+    const Blocks &compute(Instruction *v) {
+        std::unique_ptr<Blocks> &entry = Cache[v];
+        if (entry) return *entry;
+        entry.reset(new Blocks());
+        Blocks &blocks = *entry;
+        BasicBlock *def = v->getParent();
+        std::vector<BasicBlock *> worklist;
+        for (Use &use : v->uses()) {
+            Instruction *user = dyn_cast<Instruction>(use.getUser());
+            if (!user || isa<DbgInfoIntrinsic>(user)) continue;
+            if (PHINode *phi = dyn_cast<PHINode>(user)) {
+                BasicBlock *pred = phi->getIncomingBlock(use);
+                blocks.Out.insert(pred);
+                markLiveIn(pred, def, blocks, worklist);
+            } else {
+                markLiveIn(user->getParent(), def, blocks, worklist);
+            }
+        }
+        while (!worklist.empty()) {
+            BasicBlock *bb = worklist.back();
+            worklist.pop_back();
+            for (pred_iterator pi = pred_begin(bb), pe = pred_end(bb); pi != pe;
+                 ++pi) {
+                blocks.Out.insert(*pi);
+                markLiveIn(*pi, def, blocks, worklist);
+            }
+        }
+        return blocks;
+    }
+
+   public:
+    bool isLiveIn(Instruction *v, BasicBlock *bb) {
+        return compute(v).In.count(bb);
+    }
+    bool isLiveOut(Instruction *v, BasicBlock *bb) {
+        return compute(v).Out.count(bb);
+    }
+    /// Whether v is still needed right after instruction at.
+    bool isLiveAfter(Instruction *v, Instruction *at) {
+        BasicBlock *bb = at->getParent();
+        if (v->getParent() == bb && at->comesBefore(v)) return false;
+        if (isLiveOut(v, bb)) return true;
+        for (User *user : v->users()) {
+            Instruction *inst = dyn_cast<Instruction>(user);
+            if (inst && inst->getParent() == bb && !isa<PHINode>(inst) &&
+                !isa<DbgInfoIntrinsic>(inst) && at->comesBefore(inst))
+                return true;
         }
+        return false;
     }
 };
 
+/// Prints the live values at entry and exit of every block, solved either
+/// by the dense dataflow above or, with sparse set, queried from SSALiveness.
+/// Both give the same sets. With facts set it also prints the live values
+/// around every instruction, replayed by InstructionFacts from those sets.
 class Liveness : public FunctionPass {
+    bool Sparse, Facts;
+
+    static void compSparse(Function &F, const LivenessNumbering &numbering,
+                           DataflowResult<LivenessInfo>::Type *result) {
+        SSALiveness live;
+        for (BasicBlock &BB : F) {
+            std::pair<LivenessInfo, LivenessInfo> &sets =
+                (*result)[&BB] = std::make_pair(LivenessInfo(numbering),
+                                                LivenessInfo(numbering));
+            for (unsigned id = 0; id < numbering.size(); ++id) {
+                Instruction *inst = numbering.Insts[id];
+                if (live.isLiveIn(inst, &BB)) sets.first.LiveVars.set(id);
+                if (live.isLiveOut(inst, &BB)) sets.second.LiveVars.set(id);
+            }
+        }
+    }
+
    public:
     static char ID;
-    Liveness() : FunctionPass(ID) {}
+    explicit Liveness(bool sparse = false, bool facts = false)
+        : FunctionPass(ID), Sparse(sparse), Facts(facts) {}
 
     bool runOnFunction(Function &F) override {
         F.dump();
-        LivenessVisitor visitor;
+        LivenessNumbering numbering(F);
+        LivenessVisitor visitor(F, numbering);
         DataflowResult<LivenessInfo>::Type result;
-        LivenessInfo initval;
+        LivenessInfo initval(numbering);
 
-        compBackwardDataflow(&F, &visitor, &result, initval);
+        if (Sparse)
+            compSparse(F, numbering, &result);
+        else
+            compBackwardDataflow(&F, &visitor, &result, initval);
         printDataflowResult<LivenessInfo>(errs(), result);
+        if (Facts) {
+            InstructionFacts<LivenessInfo> facts(&visitor, &result, false);
+            printInstructionFacts<LivenessInfo>(errs(), &F, facts, result);
+        }
         printf("HELP!\n");
         return false;
     }
@@ -0,0 +1,236 @@
+#ifndef _PERSISTENTSET_H_
+#define _PERSISTENTSET_H_
+// Immutable, structurally shared pointer set PtsSet and map PtsMap used by PointerInfo.
+// Both are big-endian Patricia tries keyed by pointer value. A trie's shape depends only on
+// its contents and nodes are hash-consed on creation, so equal tries are the same node:
+// copying copies the root pointer, equality compares pointers, and unions share the subtrees
+// both sides have in common. Updates return a new root and leave the old trie intact.
+// Nodes live until the program exits. Iteration is in key (pointer) order, like std::set<Value*>.
+#include <llvm/ADT/Hashing.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/Value.h>
+#include <llvm/Support/MathExtras.h>
+#include <deque>
+#include <iterator>
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_set>
+#include <utility>
+using namespace llvm;
+
+namespace persistent {
+// Leaf: mask is 0, key and value are the entry. Branch: key is the common prefix and mask the
+// bit that splits the subtrees; keys in left have that bit clear.
+template <class V>
+struct Node {
+    uintptr_t key;
+    uintptr_t mask;
+    const Node *left, *right;
+    V value;
+    size_t hash;
+};
+
+template <class V>
+class Trie {
+    struct NodeHash {
+        size_t operator()(const Node<V> *n) const { return n->hash; }
+    };
+    struct NodeEq {
+        bool operator()(const Node<V> *a, const Node<V> *b) const {
+            return a->key == b->key && a->mask == b->mask && a->left == b->left && a->right == b->right && a->value == b->value;
+        }
+    };
+    static std::deque<Node<V> > &arena() {
+        static std::deque<Node<V> > nodes;
+        return nodes;
+    }
+    static std::unordered_set<const Node<V> *, NodeHash, NodeEq> &table() {
+        static std::unordered_set<const Node<V> *, NodeHash, NodeEq> nodes;
+        return nodes;
+    }
+    static const Node<V> *make(uintptr_t key, uintptr_t mask, const Node<V> *left, const Node<V> *right, const V &value) {
+        Node<V> probe = {key, mask, left, right, value, (size_t)hash_combine(key, mask, left, right, value.hash())};
+        auto it = table().find(&probe);
+        if(it != table().end()) return *it;
+        arena().push_back(probe);
+        const Node<V> *node = &arena().back();
+        table().insert(node);
+        return node;
+    }
+    static bool zeroBit(uintptr_t key, uintptr_t mask) { return !(key & mask); }
+    static uintptr_t prefix(uintptr_t key, uintptr_t mask) { return (key | (mask - 1)) & ~mask; }
+    static bool matches(uintptr_t key, uintptr_t pre, uintptr_t mask) { return prefix(key, mask) == pre; }
+    static uintptr_t highestBit(uintptr_t x) { return (uintptr_t)1 << Log2_64(x); }
+    static const Node<V> *branch(uintptr_t pre, uintptr_t mask, const Node<V> *left, const Node<V> *right) {
+        return make(pre, mask, left, right, V());
+    }
+    static const Node<V> *join(uintptr_t p0, const Node<V> *t0, uintptr_t p1, const Node<V> *t1) {
+        uintptr_t mask = highestBit(p0 ^ p1);
+        if(zeroBit(p0, mask)) return branch(prefix(p0, mask), mask, t0, t1);
+        return branch(prefix(p0, mask), mask, t1, t0);
+    }
+
+public:
+    static const Node<V> *leaf(uintptr_t key, const V &value) { return make(key, 0, nullptr, nullptr, value); }
+    static const Node<V> *find(const Node<V> *t, uintptr_t key) {
+        while(t && t->mask) t = zeroBit(key, t->mask) ? t->left : t->right;
+        return t && t->key == key ? t : nullptr;
+    }
+    // Inserts key; an existing entry becomes combine(old value, value)
+    template <class Combine>
+    static const Node<V> *insert(const Node<V> *t, uintptr_t key, const V &value, Combine combine) {
+        if(!t) return leaf(key, value);
+        if(!t->mask) {
+            if(t->key == key) return leaf(key, combine(t->value, value));
+            return join(key, leaf(key, value), t->key, t);
+        }
+        if(!matches(key, t->key, t->mask)) return join(key, leaf(key, value), t->key, t);
+        if(zeroBit(key, t->mask)) return branch(t->key, t->mask, insert(t->left, key, value, combine), t->right);
+        return branch(t->key, t->mask, t->left, insert(t->right, key, value, combine));
+    }
+    // Union of two tries; keys in both get combine(value in s, value in t)
+    template <class Combine>
+    static const Node<V> *unite(const Node<V> *s, const Node<V> *t, Combine combine) {
+        if(s == t || !t) return s;
+        if(!s) return t;
+        if(!s->mask) return insert(t, s->key, s->value, [&](const V &tv, const V &sv) { return combine(sv, tv); });
+        if(!t->mask) return insert(s, t->key, t->value, combine);
+        if(s->mask == t->mask && s->key == t->key)
+            return branch(s->key, s->mask, unite(s->left, t->left, combine), unite(s->right, t->right, combine));
+        if(s->mask > t->mask && matches(t->key, s->key, s->mask)) {
+            if(zeroBit(t->key, s->mask)) return branch(s->key, s->mask, unite(s->left, t, combine), s->right);
+            return branch(s->key, s->mask, s->left, unite(s->right, t, combine));
+        }
+        if(s->mask < t->mask && matches(s->key, t->key, t->mask)) {
+            if(zeroBit(s->key, t->mask)) return branch(t->key, t->mask, unite(s, t->left, combine), t->right);
+            return branch(t->key, t->mask, t->left, unite(s, t->right, combine));
+        }
+        return join(s->key, s, t->key, t);
+    }
+
+    // Visits the leaves in increasing key order
+    class iterator {
+        SmallVector<const Node<V> *, 16> pending;
+        const Node<V> *current;
+        void descend(const Node<V> *t) {
+            while(t && t->mask) {
+                pending.push_back(t->right);
+                t = t->left;
+            }
+            current = t;
+        }
+
+    public:
+        explicit iterator(const Node<V> *root) : current(nullptr) { descend(root); }
+        const Node<V> *operator*() const { return current; }
+        iterator &operator++() {
+            if(pending.empty()) current = nullptr;
+            else {
+                const Node<V> *next = pending.pop_back_val();
+                descend(next);
+            }
+            return *this;
+        }
+        bool operator==(const iterator &other) const { return current == other.current; }
+        bool operator!=(const iterator &other) const { return current != other.current; }
+    };
+};
+
+struct Unit {
+    bool operator==(const Unit &) const { return true; }
+    size_t hash() const { return 0; }
+};
+}  // namespace persistent
+
+class PtsSet {
+    typedef persistent::Trie<persistent::Unit> Trie;
+    const persistent::Node<persistent::Unit> *root;
+    static persistent::Unit keep(persistent::Unit a, persistent::Unit) { return a; }
+
+public:
+    class iterator {
+        Trie::iterator it;
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Value *value_type;
+        typedef ptrdiff_t difference_type;
+        typedef Value *const *pointer;
+        typedef Value *reference;
+        explicit iterator(Trie::iterator it) : it(it) {}
+        Value *operator*() const { return (Value *)(*it)->key; }
+        iterator &operator++() {
+            ++it;
+            return *this;
+        }
+        bool operator!=(const iterator &other) const { return it != other.it; }
+        bool operator==(const iterator &other) const { return it == other.it; }
+    };
+    PtsSet() : root(nullptr) {}
+    template <class It>
+    PtsSet(It begin, It end) : root(nullptr) {
+        for(; begin != end; ++begin) insert(*begin);
+    }
+    iterator begin() const { return iterator(Trie::iterator(root)); }
+    iterator end() const { return iterator(Trie::iterator(nullptr)); }
+    bool empty() const { return !root; }
+    bool count(Value *v) const { return Trie::find(root, (uintptr_t)v) != nullptr; }
+    void clear() { root = nullptr; }
+    void insert(Value *v) { root = Trie::insert(root, (uintptr_t)v, persistent::Unit(), keep); }
+    void insert(const PtsSet &other) { root = Trie::unite(root, other.root, keep); }
+    bool operator==(const PtsSet &other) const { return root == other.root; }
+    bool operator!=(const PtsSet &other) const { return root != other.root; }
+    size_t hash() const { return hash_value(root); }
+};
+
+// Value* -> PtsSet. A key with an empty set is distinct from a missing key
+class PtsMap {
+    typedef persistent::Trie<PtsSet> Trie;
+    const persistent::Node<PtsSet> *root;
+    static PtsSet overwrite(const PtsSet &, const PtsSet &b) { return b; }
+    static PtsSet unite(const PtsSet &a, const PtsSet &b) {
+        PtsSet res = a;
+        res.insert(b);
+        return res;
+    }
+
+public:
+    class iterator {
+        Trie::iterator it;
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<Value *, PtsSet> value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const value_type *pointer;
+        typedef value_type reference;
+        explicit iterator(Trie::iterator it) : it(it) {}
+        std::pair<Value *, PtsSet> operator*() const { return std::make_pair((Value *)(*it)->key, (*it)->value); }
+        iterator &operator++() {
+            ++it;
+            return *this;
+        }
+        bool operator!=(const iterator &other) const { return it != other.it; }
+        bool operator==(const iterator &other) const { return it == other.it; }
+    };
+    PtsMap() : root(nullptr) {}
+    iterator begin() const { return iterator(Trie::iterator(root)); }
+    iterator end() const { return iterator(Trie::iterator(nullptr)); }
+    bool empty() const { return !root; }
+    bool count(Value *key) const { return Trie::find(root, (uintptr_t)key) != nullptr; }
+    // Empty set for a missing key; does not insert it
+    PtsSet get(Value *key) const {
+        const persistent::Node<PtsSet> *n = Trie::find(root, (uintptr_t)key);
+        return n ? n->value : PtsSet();
+    }
+    void clear() { root = nullptr; }
+    // Replaces the set of key with s
+    void set(Value *key, const PtsSet &s) { root = Trie::insert(root, (uintptr_t)key, s, overwrite); }
+    // Merges s into the set of key
+    void insert(Value *key, const PtsSet &s) { root = Trie::insert(root, (uintptr_t)key, s, unite); }
+    // Merges other key by key
+    void merge(const PtsMap &other) { root = Trie::unite(root, other.root, unite); }
+    bool operator==(const PtsMap &other) const { return root == other.root; }
+    bool operator!=(const PtsMap &other) const { return root != other.root; }
+};
+#endif /* !_PERSISTENTSET_H_ */